@@ -0,0 +1,242 @@
+#include "allocator.hpp"
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include "LinearMath/btAlignedAllocator.h"
+#include "constant.hpp"
+#include "platform.hpp"
+#include "util.hpp"
+
+namespace {
+// Every block is preceded by a header of this size, which also keeps the
+// payload aligned to 16 bytes as Bullet requires.
+constexpr size_t headerSize = 16;
+constexpr std::array<size_t, 8> sizeClasses = {16, 32, 64, 128, 256, 512, 1024, 2048};
+constexpr uint32_t largeClass = sizeClasses.size();
+constexpr size_t chunkSize = 64 * 1024;
+
+struct Header {
+    uint32_t sizeClass;
+    uint32_t alignment;
+    size_t size;
+};
+static_assert(sizeof(Header) <= headerSize);
+
+struct FreeBlock {
+    FreeBlock *next;
+};
+
+std::array<FreeBlock *, sizeClasses.size()> freeLists({});
+Allocator::Stats stats({});
+size_t currentFrameAllocs = 0;
+
+uint32_t findSizeClass(size_t size) {
+    for (uint32_t i = 0; i < sizeClasses.size(); ++i) {
+        if (size <= sizeClasses[i])
+            return i;
+    }
+    return largeClass;
+}
+
+void refill(uint32_t sizeClass) {
+    // Chunks are never returned to the heap.  Freed blocks are recycled
+    // through the free list of its size class.
+    const size_t blockSize = headerSize + sizeClasses[sizeClass];
+    auto chunk =
+        static_cast<std::byte *>(::operator new(chunkSize, std::align_val_t(headerSize)));
+    for (size_t offset = 0; offset + blockSize <= chunkSize; offset += blockSize) {
+        auto block = reinterpret_cast<FreeBlock *>(chunk + offset + headerSize);
+        block->next = freeLists[sizeClass];
+        freeLists[sizeClass] = block;
+    }
+    stats.reservedBytes += chunkSize;
+}
+
+void *allocate(size_t size, int alignment) {
+    const size_t align = std::max(alignment, 1);
+    const uint32_t sizeClass = align <= headerSize ? findSizeClass(size) : largeClass;
+
+    std::byte *payload = nullptr;
+    if (sizeClass == largeClass) {
+        const size_t offset = std::max(align, headerSize);
+        auto base =
+            static_cast<std::byte *>(::operator new(size + offset, std::align_val_t(offset)));
+        payload = base + offset;
+        ++stats.largeCount;
+    } else {
+        if (!freeLists[sizeClass])
+            refill(sizeClass);
+        FreeBlock *block = freeLists[sizeClass];
+        freeLists[sizeClass] = block->next;
+        payload = reinterpret_cast<std::byte *>(block);
+    }
+
+    auto header = reinterpret_cast<Header *>(payload - headerSize);
+    header->sizeClass = sizeClass;
+    header->alignment = align;
+    header->size = size;
+
+    stats.liveBytes += size;
+    ++stats.liveCount;
+    ++currentFrameAllocs;
+    return payload;
+}
+
+void deallocate(void *ptr) {
+    if (!ptr)
+        return;
+
+    auto payload = static_cast<std::byte *>(ptr);
+    const auto header = reinterpret_cast<const Header *>(payload - headerSize);
+    const uint32_t sizeClass = header->sizeClass;
+    stats.liveBytes -= header->size;
+    --stats.liveCount;
+
+    if (sizeClass == largeClass) {
+        const size_t offset = std::max<size_t>(header->alignment, headerSize);
+        ::operator delete(payload - offset, std::align_val_t(offset));
+        --stats.largeCount;
+    } else {
+        auto block = reinterpret_cast<FreeBlock *>(payload);
+        block->next = freeLists[sizeClass];
+        freeLists[sizeClass] = block;
+    }
+}
+
+void *allocateDefaultAligned(size_t size) {
+    return allocate(size, headerSize);
+}
+
+#ifdef YOMMD_TRACK_ALLOCATIONS
+// Only the thread in a tracked scope, i.e. the one running frames, counts its
+// allocations.  Workers decoding textures meanwhile allocate as they like.
+thread_local bool isTracking = false;
+size_t allocCount = 0;
+size_t allocBytes = 0;
+size_t trackedFrames = 0;
+AllocationTracker::Counts trackedStats({});
+
+void countAllocation(size_t size) {
+    if (!isTracking)
+        return;
+    ++allocCount;
+    allocBytes += size;
+}
+
+void *alignedMalloc(size_t size, size_t alignment) {
+#ifdef PLATFORM_WINDOWS
+    return _aligned_malloc(size, alignment);
+#else
+    // std::aligned_alloc() requires the size to be a multiple of alignment.
+    return std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+#endif
+}
+
+void alignedFree(void *ptr) {
+#ifdef PLATFORM_WINDOWS
+    _aligned_free(ptr);
+#else
+    std::free(ptr);
+#endif
+}
+#endif
+}  // namespace
+
+#ifdef YOMMD_TRACK_ALLOCATIONS
+// The other forms of new and delete are implemented on top of these by the
+// standard library.
+void *operator new(size_t size) {
+    countAllocation(size);
+    if (void *ptr = std::malloc(size == 0 ? 1 : size))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void *operator new(size_t size, std::align_val_t alignment) {
+    countAllocation(size);
+    if (void *ptr = alignedMalloc(size == 0 ? 1 : size, static_cast<size_t>(alignment)))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept {
+    alignedFree(ptr);
+}
+
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept {
+    alignedFree(ptr);
+}
+
+AllocationTracker::Scope::Scope(const char *name) :
+    name_(name), begin_({.allocs = allocCount, .bytes = allocBytes}), wasTracking_(isTracking) {
+    isTracking = true;
+}
+
+AllocationTracker::Scope::~Scope() {
+    isTracking = wasTracking_;
+    const Counts counts = {
+        .allocs = allocCount - begin_.allocs,
+        .bytes = allocBytes - begin_.bytes,
+    };
+    trackedStats.allocs += counts.allocs;
+    trackedStats.bytes += counts.bytes;
+    if (counts.allocs != 0 && trackedFrames >= Constant::AllocationTrackerWarmupFrames) {
+        Err::Exit(
+            "Heap allocation in a steady state frame:", name_, "made", counts.allocs,
+            "allocations of", counts.bytes, "bytes.");
+    }
+}
+
+void AllocationTracker::EndFrame() {
+    ++trackedFrames;
+}
+
+AllocationTracker::Counts AllocationTracker::GetStats() {
+    return trackedStats;
+}
+
+void AllocationTracker::ResetStats() {
+    trackedStats = {};
+}
+#else
+void AllocationTracker::EndFrame() {}
+
+AllocationTracker::Counts AllocationTracker::GetStats() {
+    return {};
+}
+
+void AllocationTracker::ResetStats() {}
+#endif
+
+void Allocator::Install() {
+    btAlignedAllocSetCustom(allocateDefaultAligned, deallocate);
+    btAlignedAllocSetCustomAligned(allocate, deallocate);
+}
+
+void Allocator::EndFrame() {
+    ++stats.frames;
+    stats.frameAllocs += currentFrameAllocs;
+    stats.maxFrameAllocs = std::max(stats.maxFrameAllocs, currentFrameAllocs);
+    currentFrameAllocs = 0;
+}
+
+Allocator::Stats Allocator::GetStats() {
+    return stats;
+}
+
+void Allocator::ResetFrameStats() {
+    stats.frames = 0;
+    stats.frameAllocs = 0;
+    stats.maxFrameAllocs = 0;
+}
@@ -0,0 +1,64 @@
+#ifndef ALLOCATOR_HPP_
+#define ALLOCATOR_HPP_
+
+#include <cstddef>
+#include "util.hpp"
+
+// Pooled allocator for Bullet.  Bullet allocates contact manifolds and
+// temporary arrays while stepping the simulation, so small blocks are served
+// from size-class pools and recycled instead of churning the global heap.
+// Bullet is used only from the main thread, so the pools are not locked.
+namespace Allocator {
+struct Stats {
+    size_t liveBytes;      // Requested bytes not freed yet.
+    size_t liveCount;      // Allocations not freed yet.
+    size_t reservedBytes;  // Bytes taken from the global heap for the pools.
+    size_t largeCount;     // Allocations too large for the pools.
+    size_t frames;         // Frames since the last ResetFrameStats().
+    size_t frameAllocs;    // Allocations since the last ResetFrameStats().
+    size_t maxFrameAllocs;
+};
+
+// Install the allocator into Bullet.  This must be called before any object
+// of Bullet is made, since blocks from the default allocator can't be freed
+// by this allocator.
+void Install();
+void EndFrame();
+Stats GetStats();
+void ResetFrameStats();
+}  // namespace Allocator
+
+// Counts heap allocations through the global operator new made by the thread
+// of a scope during its lifetime.  Only works in the build with YOMMD_TRACK_ALLOCATIONS
+// defined, i.e. "make TRACK_ALLOC=1"; otherwise this does nothing.  Once the
+// first frames are over, an allocation in a tracked scope is a fatal error so
+// that a steady state frame which touches the heap can't go unnoticed.
+namespace AllocationTracker {
+struct Counts {
+    size_t allocs;
+    size_t bytes;
+};
+
+class Scope : private NonCopyable {
+public:
+#ifdef YOMMD_TRACK_ALLOCATIONS
+    explicit Scope(const char *name);
+    ~Scope();
+
+private:
+    const char *name_;
+    Counts begin_;
+    bool wasTracking_;
+#else
+    explicit Scope(const char *) {}
+#endif
+};
+
+void EndFrame();
+
+// Allocations in tracked scopes since the last ResetStats().
+Counts GetStats();
+void ResetStats();
+}  // namespace AllocationTracker
+
+#endif  // ALLOCATOR_HPP_
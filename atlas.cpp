@@ -0,0 +1,108 @@
+#include "atlas.hpp"
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+
+namespace {
+// Copy "src" of "width" x "height" pixels into "dst" at ("x", "y"), and fill
+// "padding" pixels around it by repeating its edge pixels.
+void blit(
+    uint8_t *dst,
+    int dstSize,
+    const uint8_t *src,
+    int width,
+    int height,
+    int x,
+    int y,
+    int padding) {
+    const size_t srcPitch = static_cast<size_t>(width) * 4;
+    const size_t dstPitch = static_cast<size_t>(dstSize) * 4;
+    for (int row = -padding; row < height + padding; ++row) {
+        const uint8_t *srcRow = src + srcPitch * std::clamp(row, 0, height - 1);
+        uint8_t *dstRow = dst + dstPitch * (y + row) + static_cast<size_t>(x) * 4;
+        for (int col = -padding; col < 0; ++col)
+            std::memcpy(dstRow + col * 4, srcRow, 4);
+        std::memcpy(dstRow, srcRow, srcPitch);
+        for (int col = width; col < width + padding; ++col)
+            std::memcpy(dstRow + col * 4, srcRow + srcPitch - 4, 4);
+    }
+}
+}  // namespace
+
+namespace Atlas {
+std::vector<Placement> Pack(
+    const std::vector<const Image *>& images, int atlasSize, int padding, size_t& atlasCount) {
+    // Taller images first, so that the shelves waste less space above shorter
+    // images.
+    std::vector<size_t> order(images.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::ranges::stable_sort(order, [&images](size_t a, size_t b) {
+        return images[a]->height > images[b]->height;
+    });
+
+    std::vector<Placement> placements(images.size());
+    size_t atlas = 0;
+    int shelfX = 0;
+    int shelfY = 0;
+    int shelfHeight = 0;
+    for (const size_t i : order) {
+        const int width = images[i]->width + padding * 2;
+        const int height = images[i]->height + padding * 2;
+        if (shelfX + width > atlasSize) {
+            shelfY += shelfHeight;
+            shelfX = 0;
+            shelfHeight = 0;
+        }
+        if (shelfY + height > atlasSize) {
+            ++atlas;
+            shelfX = 0;
+            shelfY = 0;
+            shelfHeight = 0;
+        }
+        placements[i] = {.atlas = atlas, .x = shelfX + padding, .y = shelfY + padding};
+        shelfX += width;
+        shelfHeight = std::max(shelfHeight, height);
+    }
+    atlasCount = images.empty() ? 0 : atlas + 1;
+    return placements;
+}
+
+Image Build(
+    const std::vector<const Image *>& images,
+    const std::vector<Placement>& placements,
+    size_t index,
+    int atlasSize,
+    int padding) {
+    const int levels = std::countr_zero(static_cast<unsigned int>(padding)) + 1;
+
+    Image atlas;
+    atlas.width = atlasSize;
+    atlas.height = atlasSize;
+    atlas.dataSize = static_cast<size_t>(atlasSize) * atlasSize * 4;
+    atlas.pixels.resize(atlas.dataSize);
+    for (int level = 1; level < levels; ++level) {
+        const size_t size = atlasSize >> level;
+        atlas.mipmaps.emplace_back(size * size * 4);
+    }
+
+    for (size_t i = 0; i < images.size(); ++i) {
+        const auto& image = *images[i];
+        const auto& placement = placements[i];
+        if (placement.atlas != index)
+            continue;
+        atlas.hasAlpha = atlas.hasAlpha || image.hasAlpha;
+        atlas.alphaUsage = std::max(atlas.alphaUsage, image.alphaUsage);
+        for (int level = 0; level < levels; ++level) {
+            auto& dst = level == 0 ? atlas.pixels : atlas.mipmaps[level - 1];
+            const auto& src = level == 0 ? image.pixels : image.mipmaps[level - 1];
+            blit(
+                dst.data(), atlasSize >> level, src.data(), image.width >> level,
+                image.height >> level, placement.x >> level, placement.y >> level,
+                padding >> level);
+        }
+    }
+    return atlas;
+}
+}  // namespace Atlas
@@ -0,0 +1,35 @@
+#ifndef ATLAS_HPP_
+#define ATLAS_HPP_
+
+#include <cstddef>
+#include <vector>
+#include "image.hpp"
+
+// Packs small images into shared images, atlases, so that materials using them
+// are drawn without switching textures.  Each image is surrounded by copies of
+// its edge pixels so that filtering doesn't bring in its neighbors.
+namespace Atlas {
+struct Placement {
+    size_t atlas;  // Index of the atlas.
+    int x;         // Position of the image in pixels, excluding the padding.
+    int y;
+};
+
+// Place "images" on shelves of square atlases of "atlasSize" pixels, each with
+// "padding" pixels around it.  Images must fit in an atlas with the padding.
+std::vector<Placement> Pack(
+    const std::vector<const Image *>& images, int atlasSize, int padding, size_t& atlasCount);
+
+// Make the atlas "index" of "placements".  "padding" must be a power of 2 and
+// the sizes of the images its multiples, so that the mip levels of the images
+// are copied into the atlas as they are while the padding is at least a pixel,
+// which decides the number of mip levels of the atlas.
+Image Build(
+    const std::vector<const Image *>& images,
+    const std::vector<Placement>& placements,
+    size_t index,
+    int atlasSize,
+    int padding);
+}  // namespace Atlas
+
+#endif  // ATLAS_HPP_
@@ -0,0 +1,479 @@
+#include "bcn.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <utility>
+
+namespace {
+using Pixel = std::array<uint8_t, 4>;
+using Block = std::array<Pixel, 16>;  // Pixels of a 4x4 block in row-major order.
+
+// Interpolation weights of 4-bit indices of BC7 in 1/64.
+constexpr std::array<int, 16> bc7Weights = {
+    0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64,
+};
+
+class BitWriter {
+public:
+    explicit BitWriter(uint8_t *out) : out_(out), pos_(0) {}
+    void Write(uint32_t value, int bits) {
+        for (int i = 0; i < bits; ++i, ++pos_) {
+            if ((value >> i) & 1)
+                out_[pos_ / 8] |= 1 << (pos_ % 8);
+        }
+    }
+
+private:
+    uint8_t *out_;
+    size_t pos_;
+};
+
+class BitReader {
+public:
+    explicit BitReader(const uint8_t *in) : in_(in), pos_(0) {}
+    uint32_t Read(int bits) {
+        uint32_t value = 0;
+        for (int i = 0; i < bits; ++i, ++pos_)
+            value |= ((in_[pos_ / 8] >> (pos_ % 8)) & 1u) << i;
+        return value;
+    }
+
+private:
+    const uint8_t *in_;
+    size_t pos_;
+};
+
+Block loadBlock(const uint8_t *pixels, int width, int height, int bx, int by) {
+    Block block;
+    for (int y = 0; y < 4; ++y) {
+        const size_t sy = std::min(by * 4 + y, height - 1);
+        for (int x = 0; x < 4; ++x) {
+            const size_t sx = std::min(bx * 4 + x, width - 1);
+            std::memcpy(block[y * 4 + x].data(), pixels + (sy * width + sx) * 4, 4);
+        }
+    }
+    return block;
+}
+
+void storeBlock(const Block& block, uint8_t *pixels, int width, int height, int bx, int by) {
+    for (int y = 0; y < 4 && by * 4 + y < height; ++y) {
+        const size_t dy = by * 4 + y;
+        for (int x = 0; x < 4 && bx * 4 + x < width; ++x) {
+            const size_t dx = bx * 4 + x;
+            std::memcpy(pixels + (dy * width + dx) * 4, block[y * 4 + x].data(), 4);
+        }
+    }
+}
+
+template <size_t N>
+int getDistance(const Pixel& p, const std::array<uint8_t, N>& q) {
+    int d = 0;
+    for (size_t c = 0; c < N; ++c)
+        d += (p[c] - q[c]) * (p[c] - q[c]);
+    return d;
+}
+
+template <size_t N, size_t M>
+uint32_t findNearest(const Pixel& p, const std::array<std::array<uint8_t, N>, M>& palette) {
+    uint32_t nearest = 0;
+    int minDistance = std::numeric_limits<int>::max();
+    for (size_t i = 0; i < M; ++i) {
+        const int d = getDistance(p, palette[i]);
+        if (d < minDistance) {
+            minDistance = d;
+            nearest = i;
+        }
+    }
+    return nearest;
+}
+
+// Find endpoints of the first "N" channels of the block along the principal
+// axis of the colors.  The endpoints are moved inwards by "inset" of their
+// distance, as the interpolated colors rarely reach the extremes.
+template <size_t N>
+std::pair<std::array<float, N>, std::array<float, N>> findEndpoints(
+    const Block& block, float inset) {
+    std::array<float, N> mean{};
+    for (const auto& p : block) {
+        for (size_t c = 0; c < N; ++c)
+            mean[c] += p[c] / 16.0f;
+    }
+
+    std::array<std::array<float, N>, N> covariance{};
+    for (const auto& p : block) {
+        for (size_t i = 0; i < N; ++i) {
+            for (size_t j = 0; j < N; ++j)
+                covariance[i][j] += (p[i] - mean[i]) * (p[j] - mean[j]);
+        }
+    }
+
+    // Power iteration.  The axis stays zero for blocks of a single color.
+    std::array<float, N> axis;
+    axis.fill(1.0f);
+    for (int iteration = 0; iteration < 8; ++iteration) {
+        std::array<float, N> next{};
+        for (size_t i = 0; i < N; ++i) {
+            for (size_t j = 0; j < N; ++j)
+                next[i] += covariance[i][j] * axis[j];
+        }
+        float norm = 0.0f;
+        for (const float v : next)
+            norm += v * v;
+        norm = std::sqrt(norm);
+        for (size_t i = 0; i < N; ++i)
+            axis[i] = norm > 0.0f ? next[i] / norm : 0.0f;
+    }
+
+    float minT = 0.0f;
+    float maxT = 0.0f;
+    for (const auto& p : block) {
+        float t = 0.0f;
+        for (size_t c = 0; c < N; ++c)
+            t += (p[c] - mean[c]) * axis[c];
+        minT = std::min(minT, t);
+        maxT = std::max(maxT, t);
+    }
+    const float margin = (maxT - minT) * inset;
+    minT += margin;
+    maxT -= margin;
+
+    std::array<float, N> high, low;
+    for (size_t c = 0; c < N; ++c) {
+        high[c] = std::clamp(mean[c] + axis[c] * maxT, 0.0f, 255.0f);
+        low[c] = std::clamp(mean[c] + axis[c] * minT, 0.0f, 255.0f);
+    }
+    return {high, low};
+}
+
+uint16_t packRGB565(const std::array<float, 3>& color) {
+    const auto r = static_cast<uint16_t>(std::lround(color[0] * 31.0f / 255.0f));
+    const auto g = static_cast<uint16_t>(std::lround(color[1] * 63.0f / 255.0f));
+    const auto b = static_cast<uint16_t>(std::lround(color[2] * 31.0f / 255.0f));
+    return (r << 11) | (g << 5) | b;
+}
+
+std::array<uint8_t, 3> unpackRGB565(uint16_t v) {
+    const uint8_t r = (v >> 11) & 31;
+    const uint8_t g = (v >> 5) & 63;
+    const uint8_t b = v & 31;
+    return {
+        static_cast<uint8_t>((r << 3) | (r >> 2)),
+        static_cast<uint8_t>((g << 2) | (g >> 4)),
+        static_cast<uint8_t>((b << 3) | (b >> 2)),
+    };
+}
+
+std::array<std::array<uint8_t, 3>, 4> getColorPalette(uint16_t c0, uint16_t c1, bool bc1) {
+    std::array<std::array<uint8_t, 3>, 4> palette = {unpackRGB565(c0), unpackRGB565(c1)};
+    for (size_t c = 0; c < 3; ++c) {
+        const int p0 = palette[0][c];
+        const int p1 = palette[1][c];
+        if (c0 > c1 || !bc1) {
+            palette[2][c] = (2 * p0 + p1) / 3;
+            palette[3][c] = (p0 + 2 * p1) / 3;
+        } else {
+            palette[2][c] = (p0 + p1) / 2;
+            palette[3][c] = 0;
+        }
+    }
+    return palette;
+}
+
+std::array<std::array<uint8_t, 1>, 8> getAlphaPalette(uint8_t a0, uint8_t a1) {
+    std::array<std::array<uint8_t, 1>, 8> palette = {{{a0}, {a1}}};
+    if (a0 > a1) {
+        for (int i = 2; i < 8; ++i)
+            palette[i][0] = ((8 - i) * a0 + (i - 1) * a1) / 7;
+    } else {
+        for (int i = 2; i < 6; ++i)
+            palette[i][0] = ((6 - i) * a0 + (i - 1) * a1) / 5;
+        palette[6][0] = 0;
+        palette[7][0] = 255;
+    }
+    return palette;
+}
+
+// Encode colors in the 4-color mode.
+void encodeColor(const Block& block, uint8_t *out) {
+    const auto [high, low] = findEndpoints<3>(block, 1.0f / 16.0f);
+    uint16_t c0 = packRGB565(high);
+    uint16_t c1 = packRGB565(low);
+    if (c0 < c1)
+        std::swap(c0, c1);
+
+    uint32_t indices = 0;
+    if (c0 != c1) {
+        const auto palette = getColorPalette(c0, c1, true);
+        for (size_t i = 0; i < block.size(); ++i)
+            indices |= findNearest(block[i], palette) << (2 * i);
+    }
+    for (int i = 0; i < 2; ++i) {
+        out[i] = static_cast<uint8_t>(c0 >> (8 * i));
+        out[2 + i] = static_cast<uint8_t>(c1 >> (8 * i));
+    }
+    for (int i = 0; i < 4; ++i)
+        out[4 + i] = static_cast<uint8_t>(indices >> (8 * i));
+}
+
+void decodeColor(const uint8_t *in, Block& block, bool bc1) {
+    const uint16_t c0 = in[0] | (in[1] << 8);
+    const uint16_t c1 = in[2] | (in[3] << 8);
+    const uint32_t indices = in[4] | (in[5] << 8) | (in[6] << 16) | (in[7] << 24);
+    const auto palette = getColorPalette(c0, c1, bc1);
+    for (size_t i = 0; i < block.size(); ++i) {
+        const uint32_t index = (indices >> (2 * i)) & 3;
+        std::copy(palette[index].cbegin(), palette[index].cend(), block[i].begin());
+        block[i][3] = bc1 && c0 <= c1 && index == 3 ? 0 : 255;
+    }
+}
+
+// Encode alpha in the 8-value mode.
+void encodeAlpha(const Block& block, uint8_t *out) {
+    uint8_t a0 = 0;
+    uint8_t a1 = 255;
+    for (const auto& p : block) {
+        a0 = std::max(a0, p[3]);
+        a1 = std::min(a1, p[3]);
+    }
+
+    uint64_t indices = 0;
+    if (a0 != a1) {
+        const auto palette = getAlphaPalette(a0, a1);
+        for (size_t i = 0; i < block.size(); ++i) {
+            const Pixel alpha = {block[i][3]};
+            indices |= static_cast<uint64_t>(findNearest(alpha, palette)) << (3 * i);
+        }
+    }
+    out[0] = a0;
+    out[1] = a1;
+    for (int i = 0; i < 6; ++i)
+        out[2 + i] = static_cast<uint8_t>(indices >> (8 * i));
+}
+
+void decodeAlpha(const uint8_t *in, Block& block) {
+    uint64_t indices = 0;
+    for (int i = 0; i < 6; ++i)
+        indices |= static_cast<uint64_t>(in[2 + i]) << (8 * i);
+    const auto palette = getAlphaPalette(in[0], in[1]);
+    for (size_t i = 0; i < block.size(); ++i)
+        block[i][3] = palette[(indices >> (3 * i)) & 7][0];
+}
+
+std::array<uint8_t, 4> interpolateBC7(
+    const std::array<uint8_t, 4>& e0, const std::array<uint8_t, 4>& e1, int weight) {
+    std::array<uint8_t, 4> color;
+    for (size_t c = 0; c < color.size(); ++c)
+        color[c] = ((64 - weight) * e0[c] + weight * e1[c] + 32) >> 6;
+    return color;
+}
+
+// An endpoint of BC7 mode 6 with 7 bits per channel and a p-bit.
+struct BC7Endpoint {
+    std::array<uint8_t, 4> color;
+    uint32_t pbit;
+
+    std::array<uint8_t, 4> Expand() const {
+        std::array<uint8_t, 4> expanded;
+        for (size_t c = 0; c < color.size(); ++c)
+            expanded[c] = (color[c] << 1) | pbit;
+        return expanded;
+    }
+};
+
+// Quantize an endpoint with the p-bit giving the less error.
+BC7Endpoint quantizeBC7(const std::array<float, 4>& e) {
+    BC7Endpoint best{};
+    float minError = std::numeric_limits<float>::max();
+    for (uint32_t p = 0; p < 2; ++p) {
+        BC7Endpoint q = {.color = {}, .pbit = p};
+        float error = 0.0f;
+        for (size_t c = 0; c < q.color.size(); ++c) {
+            const long v = std::lround((e[c] - p) / 2.0f);
+            q.color[c] = static_cast<uint8_t>(std::clamp(v, 0L, 127L));
+            const float d = ((q.color[c] << 1) | p) - e[c];
+            error += d * d;
+        }
+        if (error < minError) {
+            minError = error;
+            best = q;
+        }
+    }
+    return best;
+}
+
+std::array<uint32_t, 16> findBC7Indices(
+    const Block& block, const BC7Endpoint& e0, const BC7Endpoint& e1) {
+    const auto expanded0 = e0.Expand();
+    const auto expanded1 = e1.Expand();
+    std::array<std::array<uint8_t, 4>, 16> palette;
+    for (size_t i = 0; i < palette.size(); ++i)
+        palette[i] = interpolateBC7(expanded0, expanded1, bc7Weights[i]);
+    std::array<uint32_t, 16> indices;
+    for (size_t i = 0; i < block.size(); ++i)
+        indices[i] = findNearest(block[i], palette);
+    return indices;
+}
+
+// Encode in mode 6: one subset of RGBA endpoints and 4-bit indices.
+void encodeBC7(const Block& block, uint8_t *out) {
+    const auto [high, low] = findEndpoints<4>(block, 1.0f / 64.0f);
+    auto e0 = quantizeBC7(high);
+    auto e1 = quantizeBC7(low);
+    auto indices = findBC7Indices(block, e0, e1);
+
+    // Refit the endpoints to the chosen indices by least squares once.
+    float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+    std::array<float, 4> ax{}, bx{};
+    for (size_t i = 0; i < block.size(); ++i) {
+        const float w = bc7Weights[indices[i]] / 64.0f;
+        aa += (1.0f - w) * (1.0f - w);
+        ab += (1.0f - w) * w;
+        bb += w * w;
+        for (size_t c = 0; c < 4; ++c) {
+            ax[c] += (1.0f - w) * block[i][c];
+            bx[c] += w * block[i][c];
+        }
+    }
+    if (const float det = aa * bb - ab * ab; std::abs(det) > 1e-6f) {
+        std::array<float, 4> refitHigh, refitLow;
+        for (size_t c = 0; c < 4; ++c) {
+            refitHigh[c] = std::clamp((ax[c] * bb - bx[c] * ab) / det, 0.0f, 255.0f);
+            refitLow[c] = std::clamp((bx[c] * aa - ax[c] * ab) / det, 0.0f, 255.0f);
+        }
+        e0 = quantizeBC7(refitHigh);
+        e1 = quantizeBC7(refitLow);
+        indices = findBC7Indices(block, e0, e1);
+    }
+
+    // The top bit of the index of the first pixel is implicitly 0.
+    if (indices[0] >= 8) {
+        std::swap(e0, e1);
+        for (auto& index : indices)
+            index = 15 - index;
+    }
+
+    std::memset(out, 0, 16);
+    BitWriter writer(out);
+    writer.Write(1 << 6, 7);
+    for (size_t c = 0; c < 4; ++c) {
+        writer.Write(e0.color[c], 7);
+        writer.Write(e1.color[c], 7);
+    }
+    writer.Write(e0.pbit, 1);
+    writer.Write(e1.pbit, 1);
+    writer.Write(indices[0], 3);
+    for (size_t i = 1; i < indices.size(); ++i)
+        writer.Write(indices[i], 4);
+}
+
+void decodeBC7(const uint8_t *in, Block& block) {
+    BitReader reader(in);
+    if (reader.Read(7) != 1 << 6) {
+        block.fill({0, 0, 0, 0});
+        return;
+    }
+    std::array<uint8_t, 4> e0, e1;
+    for (size_t c = 0; c < 4; ++c) {
+        e0[c] = reader.Read(7) << 1;
+        e1[c] = reader.Read(7) << 1;
+    }
+    const uint32_t p0 = reader.Read(1);
+    const uint32_t p1 = reader.Read(1);
+    for (size_t c = 0; c < 4; ++c) {
+        e0[c] |= p0;
+        e1[c] |= p1;
+    }
+    for (size_t i = 0; i < block.size(); ++i)
+        block[i] = interpolateBC7(e0, e1, bc7Weights[reader.Read(i == 0 ? 3 : 4)]);
+}
+}  // namespace
+
+namespace BCn {
+std::string_view GetName(Format format) {
+    switch (format) {
+    case Format::BC1:
+        return "BC1";
+    case Format::BC3:
+        return "BC3";
+    case Format::BC7:
+        return "BC7";
+    }
+    return "";
+}
+
+size_t GetBlockSize(Format format) {
+    return format == Format::BC1 ? 8 : 16;
+}
+
+size_t GetEncodedSize(Format format, int width, int height) {
+    return static_cast<size_t>((width + 3) / 4) * ((height + 3) / 4) * GetBlockSize(format);
+}
+
+std::vector<uint8_t> Encode(Format format, const uint8_t *pixels, int width, int height) {
+    const size_t blockSize = GetBlockSize(format);
+    const int blocksX = (width + 3) / 4;
+    const int blocksY = (height + 3) / 4;
+    std::vector<uint8_t> blocks(GetEncodedSize(format, width, height));
+    for (int by = 0; by < blocksY; ++by) {
+        for (int bx = 0; bx < blocksX; ++bx) {
+            const auto block = loadBlock(pixels, width, height, bx, by);
+            const size_t offset = (static_cast<size_t>(by) * blocksX + bx) * blockSize;
+            uint8_t *out = blocks.data() + offset;
+            switch (format) {
+            case Format::BC1:
+                encodeColor(block, out);
+                break;
+            case Format::BC3:
+                encodeAlpha(block, out);
+                encodeColor(block, out + 8);
+                break;
+            case Format::BC7:
+                encodeBC7(block, out);
+                break;
+            }
+        }
+    }
+    return blocks;
+}
+
+std::vector<uint8_t> Decode(Format format, const uint8_t *blocks, int width, int height) {
+    const size_t blockSize = GetBlockSize(format);
+    const int blocksX = (width + 3) / 4;
+    const int blocksY = (height + 3) / 4;
+    std::vector<uint8_t> pixels(static_cast<size_t>(width) * height * 4);
+    for (int by = 0; by < blocksY; ++by) {
+        for (int bx = 0; bx < blocksX; ++bx) {
+            const uint8_t *in = blocks + (static_cast<size_t>(by) * blocksX + bx) * blockSize;
+            Block block;
+            switch (format) {
+            case Format::BC1:
+                decodeColor(in, block, true);
+                break;
+            case Format::BC3:
+                decodeColor(in + 8, block, false);
+                decodeAlpha(in, block);
+                break;
+            case Format::BC7:
+                decodeBC7(in, block);
+                break;
+            }
+            storeBlock(block, pixels.data(), width, height, bx, by);
+        }
+    }
+    return pixels;
+}
+
+double ComputePSNR(const std::vector<uint8_t>& a, const std::vector<uint8_t>& b) {
+    const size_t size = std::min(a.size(), b.size());
+    double squaredError = 0.0;
+    for (size_t i = 0; i < size; ++i) {
+        const double d = static_cast<double>(a[i]) - b[i];
+        squaredError += d * d;
+    }
+    if (squaredError == 0.0)
+        return std::numeric_limits<double>::infinity();
+    return 10.0 * std::log10(255.0 * 255.0 * size / squaredError);
+}
+}  // namespace BCn
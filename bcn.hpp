@@ -0,0 +1,32 @@
+#ifndef BCN_HPP_
+#define BCN_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+// Encoder of block compressed texture formats.  Images are encoded in blocks of
+// 4x4 RGBA8 pixels from the top-left, and blocks over the right or the bottom
+// edge are padded by repeating the last column or row.
+namespace BCn {
+enum class Format {
+    BC1,  // RGB in 8 bytes per block.
+    BC3,  // RGB and interpolated alpha in 16 bytes per block.
+    BC7,  // RGBA in 16 bytes per block.  Only mode 6 is used.
+};
+
+std::string_view GetName(Format format);
+size_t GetBlockSize(Format format);
+size_t GetEncodedSize(Format format, int width, int height);
+std::vector<uint8_t> Encode(Format format, const uint8_t *pixels, int width, int height);
+
+// Decode blocks made by Encode() back into RGBA8 pixels to measure the quality
+// of the encoding.
+std::vector<uint8_t> Decode(Format format, const uint8_t *blocks, int width, int height);
+
+// Peak signal-to-noise ratio of "b" against "a" in dB over all the channels.
+double ComputePSNR(const std::vector<uint8_t>& a, const std::vector<uint8_t>& b);
+}  // namespace BCn
+
+#endif  // BCN_HPP_
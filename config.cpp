@@ -19,12 +19,23 @@ inline glm::vec3 toVec3(const std::array<float, 3> a) {
 Config::Config() :
     simulationFPS(60.0f),
     gravity(9.8f),
+    physicsLOD(true),
+    dualQuaternionSkinning(false),
     lightDirection(-0.5f, -1.0f, -0.5f),
     defaultModelPosition(0.0f, 0.0f),
     defaultScale(1.0f),
     defaultCameraPosition(0, 10, 50),
     defaultGazePosition(0, 10, 0),
-    defaultScreenNumber(std::nullopt) {}
+    defaultScreenNumber(std::nullopt),
+    physicsSnapshotCache(std::nullopt),
+    statsInterval(0.0f),
+    vertexCacheSize(0),
+    textureBudget(0),
+    textureCompression(false),
+    textureStreaming(false),
+    textureAtlas(false),
+    keyframeRotationTolerance(0.0f),
+    keyframeTranslationTolerance(0.0f) {}
 
 Config Config::Parse(const std::filesystem::path& configFile) {
     namespace fs = std::filesystem;
@@ -72,11 +83,50 @@ Config Config::Parse(const std::filesystem::path& configFile) {
                 config.simulationFPS = v.as_floating();
             } else if (k == "gravity") {
                 config.gravity = v.as_floating();
+            } else if (k == "physics-lod") {
+                config.physicsLOD = v.as_boolean();
+            } else if (k == "dual-quaternion-skinning") {
+                config.dualQuaternionSkinning = v.as_boolean();
             } else if (k == "light-direction") {
                 const auto d = toml::get<std::array<float, 3>>(v);
                 config.lightDirection = toVec3(d);
             } else if (k == "default-screen-number") {
                 config.defaultScreenNumber = v.as_integer();
+            } else if (k == "physics-snapshot-cache") {
+                const auto path = toml::get<std::u8string>(v);
+                config.physicsSnapshotCache = ::Path::makeAbsolute(fs::path(path), configDir);
+            } else if (k == "stats-interval") {
+                config.statsInterval = v.as_floating();
+            } else if (k == "vertex-cache-size") {
+                const auto mib = v.as_integer();
+                if (mib < 0) {
+                    const auto errmsg = toml::format_error(
+                        "Invalid value for \"vertex-cache-size\"", v,
+                        "Value must be bigger than or equals to 0.");
+                    Err::Log(errmsg);
+                } else {
+                    config.vertexCacheSize = static_cast<size_t>(mib) * 1024 * 1024;
+                }
+            } else if (k == "texture-budget") {
+                const auto mib = v.as_integer();
+                if (mib < 0) {
+                    const auto errmsg = toml::format_error(
+                        "Invalid value for \"texture-budget\"", v,
+                        "Value must be bigger than or equals to 0.");
+                    Err::Log(errmsg);
+                } else {
+                    config.textureBudget = static_cast<size_t>(mib) * 1024 * 1024;
+                }
+            } else if (k == "texture-compression") {
+                config.textureCompression = v.as_boolean();
+            } else if (k == "texture-streaming") {
+                config.textureStreaming = v.as_boolean();
+            } else if (k == "texture-atlas") {
+                config.textureAtlas = v.as_boolean();
+            } else if (k == "keyframe-rotation-tolerance") {
+                config.keyframeRotationTolerance = v.as_floating();
+            } else if (k == "keyframe-translation-tolerance") {
+                config.keyframeTranslationTolerance = v.as_floating();
             } else if (k == "motion") {
                 for (const auto& m : v.as_array()) {
                     // Ensure all the required key appear in "motion" table.
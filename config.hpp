@@ -1,6 +1,7 @@
 #ifndef CONFIG_HPP_
 #define CONFIG_HPP_
 
+#include <cstddef>
 #include <filesystem>
 #include <optional>
 #include <vector>
@@ -21,12 +22,23 @@ struct Config {
     std::vector<Motion> motions;
     float simulationFPS;
     float gravity;
+    bool physicsLOD;
+    bool dualQuaternionSkinning;
     glm::vec3 lightDirection;
     glm::vec2 defaultModelPosition;
     float defaultScale;
     glm::vec3 defaultCameraPosition;
     glm::vec3 defaultGazePosition;
     std::optional<int> defaultScreenNumber;
+    std::optional<Path> physicsSnapshotCache;
+    float statsInterval;
+    size_t vertexCacheSize;  // In bytes.
+    size_t textureBudget;  // In bytes.
+    bool textureCompression;
+    bool textureStreaming;
+    bool textureAtlas;
+    float keyframeRotationTolerance;  // In degrees.
+    float keyframeTranslationTolerance;
 
     static Config Parse(const std::filesystem::path& configFile);
 };
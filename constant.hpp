@@ -1,12 +1,49 @@
 #ifndef CONSTANT_HPP_
 #define CONSTANT_HPP_
 
+#include <cstddef>
 #include <string_view>
 
 namespace Constant {
 constexpr int PreferredSampleCount = 4;
 constexpr float FPS = 60.0f;
 constexpr float VmdFPS = 30.0f;
+
+// Rate motions are sampled at when the vertex cache is enabled.  Frames are
+// cached at this rate.
+constexpr float VertexCacheFPS = 60.0f;
+
+// Alpha below which pixels of cutout materials are discarded.  Mipmaps keep the
+// coverage of their base level at this alpha.
+constexpr float AlphaCutoff = 0.5f;
+
+// Textures are not downscaled below this size to fit the texture budget.
+constexpr int MinTextureSize = 256;
+
+// Textures up to this size are packed into atlases of up to AtlasSize when the
+// texture atlas is enabled.  Each texture gets AtlasPadding pixels around it,
+// which also decides the number of mip levels of atlases.
+constexpr int AtlasMaxTextureSize = 256;
+constexpr int AtlasSize = 2048;
+constexpr int AtlasPadding = 8;
+
+// Bytes of streamed textures uploaded per frame.  A texture larger than this is
+// uploaded alone in a frame.
+constexpr size_t TextureUploadBytesPerFrame = 8 * 1024 * 1024;
+
+// Number of VMD frames used to blend from the bind pose into the first frame of
+// a motion, and to hold that frame afterwards, when settling physics for the
+// warm-start snapshot of the motion.
+constexpr int PhysicsSettleBlendFrames = 30;
+constexpr int PhysicsSettleHoldFrames = 60;
+
+// When a frame takes longer than this in seconds, physics is not stepped over
+// the gap but warm-started again.
+constexpr double PhysicsStallThreshold = 0.5;
+
+// Frames allowed to allocate before the allocation tracker regards frames as
+// in steady state.  Covers the first motion transition and growth of buffers.
+constexpr size_t AllocationTrackerWarmupFrames = 600;
 constexpr std::string_view DefaultLogFilePath = "";
 }  // namespace Constant
 
@@ -1,8 +1,28 @@
 #include "image.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cmath>
 #include <cstdio>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <optional>
 #include <string_view>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include "constant.hpp"
 #include "platform.hpp"
 #include "stb_image.h"
+#include "util.hpp"
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
 
 #ifdef PLATFORM_WINDOWS
 #include <windows.h>
@@ -22,6 +42,314 @@ private:
     FILE *fp;
 };
 
+namespace {
+struct GammaTable {
+    std::array<float, 256> toLinear;
+    std::array<uint8_t, 4096> toSRGB;  // Indexed by quantized linear value.
+};
+
+const GammaTable& getGammaTable() {
+    static const GammaTable table = [] {
+        GammaTable t;
+        for (size_t i = 0; i < t.toLinear.size(); ++i) {
+            const float c = i / 255.0f;
+            t.toLinear[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+        }
+        for (size_t i = 0; i < t.toSRGB.size(); ++i) {
+            const float l = i / static_cast<float>(t.toSRGB.size() - 1);
+            const float c =
+                l <= 0.0031308f ? l * 12.92f : 1.055f * std::pow(l, 1.0f / 2.4f) - 0.055f;
+            t.toSRGB[i] = static_cast<uint8_t>(std::lround(c * 255.0f));
+        }
+        return t;
+    }();
+    return table;
+}
+
+// Source pixels of a row or column that make each destination pixel.  Even
+// sizes are halved by a 2-tap box filter, and odd sizes by a 3-tap filter
+// whose windows overlap by weight, so that no row or column is dropped.
+struct Taps {
+    std::array<int, 3> index;
+    std::array<float, 3> weight;
+    int count;
+};
+
+std::vector<Taps> makeTaps(int size, int dsize) {
+    std::vector<Taps> taps(dsize);
+    const float n = static_cast<float>(size);
+    for (int x = 0; x < dsize; ++x) {
+        if (size == 1) {
+            taps[x] = {.index = {0, 0, 0}, .weight = {1.0f, 0.0f, 0.0f}, .count = 1};
+        } else if (size % 2 == 0) {
+            taps[x] = {
+                .index = {2 * x, 2 * x + 1, 0},
+                .weight = {0.5f, 0.5f, 0.0f},
+                .count = 2,
+            };
+        } else {
+            taps[x] = {
+                .index = {2 * x, 2 * x + 1, 2 * x + 2},
+                .weight = {(dsize - x) / n, dsize / n, (x + 1) / n},
+                .count = 3,
+            };
+        }
+    }
+    return taps;
+}
+
+// Halve an RGBA8 image of "w" x "h" into "dst" by makeTaps().  Colors are
+// weighted by alpha, so that colors of transparent pixels don't bleed into
+// their neighbors.  Pixels left all transparent get the plain average.
+void downsample(const uint8_t *src, int w, int h, uint8_t *dst, int dw, int dh) {
+    const auto& gamma = getGammaTable();
+    const float quantize = static_cast<float>(gamma.toSRGB.size() - 1);
+    const size_t stride = static_cast<size_t>(w) * 4;
+    const auto xTaps = makeTaps(w, dw);
+    const auto yTaps = makeTaps(h, dh);
+    for (int y = 0; y < dh; ++y) {
+        const auto& ty = yTaps[y];
+        uint8_t *out = dst + static_cast<size_t>(y) * dw * 4;
+        for (int x = 0; x < dw; ++x, out += 4) {
+            const auto& tx = xTaps[x];
+            std::array<float, 3> weighted{};
+            std::array<float, 3> plain{};
+            float alpha = 0.0f;
+            for (int j = 0; j < ty.count; ++j) {
+                const uint8_t *row = src + ty.index[j] * stride;
+                for (int i = 0; i < tx.count; ++i) {
+                    const uint8_t *p = row + static_cast<size_t>(tx.index[i]) * 4;
+                    const float weight = ty.weight[j] * tx.weight[i];
+                    const float a = p[3] / 255.0f * weight;
+                    for (int c = 0; c < 3; ++c) {
+                        const float l = gamma.toLinear[p[c]];
+                        weighted[c] += l * a;
+                        plain[c] += l * weight;
+                    }
+                    alpha += a;
+                }
+            }
+            for (int c = 0; c < 3; ++c) {
+                const float l = alpha > 0.0f ? std::min(weighted[c] / alpha, 1.0f) : plain[c];
+                out[c] = gamma.toSRGB[static_cast<size_t>(l * quantize + 0.5f)];
+            }
+            out[3] = static_cast<uint8_t>(std::lround(alpha * 255.0f));
+        }
+    }
+}
+
+AlphaUsage classifyAlpha(const std::vector<uint8_t>& pixels) {
+    // Branch-free reductions, so that compilers can vectorize the scan.
+    uint8_t minAlpha = 255;
+    uint8_t partial = 0;
+    for (size_t i = 3; i < pixels.size(); i += 4) {
+        const uint8_t a = pixels[i];
+        minAlpha = std::min(minAlpha, a);
+        partial |= static_cast<uint8_t>(a != 0 && a != 255);
+    }
+    if (partial)
+        return AlphaUsage::Blended;
+    return minAlpha == 255 ? AlphaUsage::Opaque : AlphaUsage::Cutout;
+}
+
+// Returns the number of pixels whose alpha is at or above each value.
+std::array<size_t, 257> countAlphaAbove(const std::vector<uint8_t>& pixels) {
+    std::array<size_t, 256> histogram{};
+    for (size_t i = 3; i < pixels.size(); i += 4)
+        ++histogram[pixels[i]];
+    std::array<size_t, 257> above{};
+    for (size_t a = histogram.size(); a > 0; --a)
+        above[a - 1] = above[a] + histogram[a - 1];
+    return above;
+}
+
+// The smallest alpha kept by the shader of cutout materials, which discards
+// pixels whose alpha is below Constant::AlphaCutoff.
+size_t getCutoffAlpha() {
+    return static_cast<size_t>(std::ceil(Constant::AlphaCutoff * 255.0f));
+}
+
+float computeAlphaCoverage(const std::vector<uint8_t>& pixels) {
+    const size_t count = pixels.size() / 4;
+    return count == 0 ? 0.0f
+                      : static_cast<float>(countAlphaAbove(pixels)[getCutoffAlpha()]) / count;
+}
+
+// Scale alpha of "pixels" so that the ratio of pixels at or above the cutoff
+// gets closest to "coverage".  Only for mip levels of cutout images, whose
+// translucent pixels come from averaging opaque and transparent ones.
+void scaleAlphaCoverage(std::vector<uint8_t>& pixels, float coverage) {
+    // Pixels all opaque or transparent keep their coverage as they are.
+    if (classifyAlpha(pixels) != AlphaUsage::Blended)
+        return;
+
+    const auto above = countAlphaAbove(pixels);
+    const float target = coverage * (pixels.size() / 4);
+
+    // Search the alpha which should be mapped onto the cutoff.  Of the ones
+    // equally close to the target, take the nearest to the cutoff so that
+    // alpha isn't scaled without need, e.g. when all pixels have one alpha.
+    const size_t cutoff = getCutoffAlpha();
+    const auto distance = [](size_t a, size_t b) { return a > b ? a - b : b - a; };
+    size_t threshold = cutoff;
+    for (size_t a = 1; a < 256; ++a) {
+        const float error = std::abs(above[a] - target);
+        const float best = std::abs(above[threshold] - target);
+        const bool nearer = distance(a, cutoff) < distance(threshold, cutoff);
+        if (error < best || (error == best && nearer))
+            threshold = a;
+    }
+
+    const float scale = cutoff / static_cast<float>(threshold);
+    if (std::abs(scale - 1.0f) < 1e-3f)
+        return;
+    for (size_t i = 3; i < pixels.size(); i += 4)
+        pixels[i] = static_cast<uint8_t>(std::min(std::lround(pixels[i] * scale), 255L));
+}
+// Uncompressed BGR or BGRA pixels in a BMP or TGA file.
+struct UncompressedLayout {
+    const uint8_t *pixels;
+    int width;
+    int height;
+    int bytesPerPixel;
+    size_t pitch;
+    bool topDown;
+};
+
+template <typename T>
+T readLE(const uint8_t *p) {
+    std::make_unsigned_t<T> v = 0;
+    for (size_t i = 0; i < sizeof(T); ++i)
+        v |= static_cast<std::make_unsigned_t<T>>(p[i]) << (8 * i);
+    return static_cast<T>(v);
+}
+
+std::optional<UncompressedLayout> parseBMP(const uint8_t *data, size_t size) {
+    if (size < 54 || data[0] != 'B' || data[1] != 'M')
+        return std::nullopt;
+    const uint32_t offset = readLE<uint32_t>(data + 10);
+    const uint32_t headerSize = readLE<uint32_t>(data + 14);
+    const int32_t width = readLE<int32_t>(data + 18);
+    const int32_t height = readLE<int32_t>(data + 22);
+    const uint16_t bpp = readLE<uint16_t>(data + 28);
+    const uint32_t compression = readLE<uint32_t>(data + 30);
+    if (headerSize < 40 || compression != 0 || (bpp != 24 && bpp != 32) || width <= 0 ||
+        height == 0 || height == std::numeric_limits<int32_t>::min())
+        return std::nullopt;
+
+    const UncompressedLayout layout = {
+        .pixels = data + offset,
+        .width = width,
+        .height = std::abs(height),
+        .bytesPerPixel = bpp / 8,
+        .pitch = (static_cast<size_t>(width) * (bpp / 8) + 3) & ~size_t{3},
+        .topDown = height < 0,
+    };
+    if (offset + layout.pitch * layout.height > size)
+        return std::nullopt;
+    return layout;
+}
+
+std::optional<UncompressedLayout> parseTGA(const uint8_t *data, size_t size) {
+    if (size < 18)
+        return std::nullopt;
+    const uint8_t idLength = data[0];
+    const uint8_t colorMapType = data[1];
+    const uint8_t imageType = data[2];
+    const uint16_t width = readLE<uint16_t>(data + 12);
+    const uint16_t height = readLE<uint16_t>(data + 14);
+    const uint8_t bpp = data[16];
+    const uint8_t descriptor = data[17];
+    // Images stored from right to left are left to stb.
+    if (colorMapType != 0 || imageType != 2 || (bpp != 24 && bpp != 32) || width == 0 ||
+        height == 0 || (descriptor & 0x10))
+        return std::nullopt;
+
+    const UncompressedLayout layout = {
+        .pixels = data + 18 + idLength,
+        .width = width,
+        .height = height,
+        .bytesPerPixel = bpp / 8,
+        .pitch = static_cast<size_t>(width) * (bpp / 8),
+        .topDown = (descriptor & 0x20) != 0,
+    };
+    if (18 + idLength + layout.pitch * layout.height > size)
+        return std::nullopt;
+    return layout;
+}
+
+// Call "f" with each index from 0 to "count" - 1 on a few threads including the
+// calling one.
+template <typename F>
+void parallelFor(size_t count, F&& f) {
+    std::atomic<size_t> next = 0;
+    const auto work = [&]() {
+        for (size_t i = next++; i < count; i = next++)
+            f(i);
+    };
+    const unsigned int cores = std::max(std::thread::hardware_concurrency(), 1u);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < std::min<size_t>(count, cores); ++i)
+        threads.emplace_back(work);
+    work();
+    for (auto& thread : threads)
+        thread.join();
+}
+
+void swizzleBGR(const uint8_t *src, uint8_t *dst, size_t count) {
+    size_t i = 0;
+#if defined(__ARM_NEON)
+    for (; i + 16 <= count; i += 16) {
+        const uint8x16x3_t bgr = vld3q_u8(src + i * 3);
+        const uint8x16x4_t rgba = {{bgr.val[2], bgr.val[1], bgr.val[0], vdupq_n_u8(255)}};
+        vst4q_u8(dst + i * 4, rgba);
+    }
+#elif defined(__SSSE3__)
+    const __m128i shuffle =
+        _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    const __m128i alpha = _mm_set1_epi32(static_cast<int>(0xff000000u));
+    // 16 bytes are loaded for 4 pixels, so leave 2 pixels not to read past the
+    // end of the row.
+    for (; i + 6 <= count; i += 4) {
+        const __m128i bgr = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 3));
+        const __m128i rgba = _mm_or_si128(_mm_shuffle_epi8(bgr, shuffle), alpha);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i * 4), rgba);
+    }
+#endif
+    for (; i < count; ++i) {
+        dst[i * 4 + 0] = src[i * 3 + 2];
+        dst[i * 4 + 1] = src[i * 3 + 1];
+        dst[i * 4 + 2] = src[i * 3 + 0];
+        dst[i * 4 + 3] = 255;
+    }
+}
+
+void swizzleBGRA(const uint8_t *src, uint8_t *dst, size_t count) {
+    size_t i = 0;
+#if defined(__ARM_NEON)
+    for (; i + 16 <= count; i += 16) {
+        uint8x16x4_t pixels = vld4q_u8(src + i * 4);
+        std::swap(pixels.val[0], pixels.val[2]);
+        vst4q_u8(dst + i * 4, pixels);
+    }
+#elif defined(__SSSE3__)
+    const __m128i shuffle =
+        _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    for (; i + 4 <= count; i += 4) {
+        const __m128i bgra = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 4));
+        _mm_storeu_si128(
+            reinterpret_cast<__m128i *>(dst + i * 4), _mm_shuffle_epi8(bgra, shuffle));
+    }
+#endif
+    for (; i < count; ++i) {
+        dst[i * 4 + 0] = src[i * 4 + 2];
+        dst[i * 4 + 1] = src[i * 4 + 1];
+        dst[i * 4 + 2] = src[i * 4 + 0];
+        dst[i * 4 + 3] = src[i * 4 + 3];
+    }
+}
+}  // namespace
+
 File::File() : fp(nullptr) {}
 
 File::File(const std::string_view path) {
@@ -62,7 +390,13 @@ File::operator bool() const {
     return fp != nullptr;
 }
 
-Image::Image() : width(0), height(0), dataSize(0), hasAlpha(false) {}
+Image::Image() :
+    width(0),
+    height(0),
+    dataSize(0),
+    hasAlpha(false),
+    alphaUsage(AlphaUsage::Opaque),
+    blockPSNR(0.0) {}
 
 Image::Image(Image&& image) {
     *this = std::move(image);
@@ -72,51 +406,131 @@ Image& Image::operator=(Image&& rhs) {
     width = rhs.width;
     height = rhs.height;
     dataSize = rhs.dataSize;
-    pixels = rhs.pixels;
+    pixels = std::move(rhs.pixels);
     hasAlpha = rhs.hasAlpha;
+    alphaUsage = rhs.alphaUsage;
+    mipmaps = std::move(rhs.mipmaps);
+    blockFormat = rhs.blockFormat;
+    blocks = std::move(rhs.blocks);
+    blockPSNR = rhs.blockPSNR;
 
     return *this;
 }
 
-bool Image::loadFromFile(const std::string_view path) {
-    // TODO: Is this really needed?
-    stbi_set_flip_vertically_on_load(true);
-    File file(path);
-
-    if (!file) {
-        Err::Log("Failed to open file:", path);
+bool Image::loadFromMemory(const Resource::View& resource) {
+    std::string error;
+    if (!decode(resource, {}, error)) {
+        Err::Log("Failed to decode image:", error);
         return false;
     }
+    return true;
+}
 
-    int comp = 0;
-    const int ret = stbi_info_from_file(file, &width, &height, &comp);
-    if (ret == 0) {
-        Err::Log("Failed to read info:", path, ':', stbi_failure_reason());
+bool Image::decode(
+    const Resource::View& resource, const DecodeOptions& options, std::string& error) {
+    if (!loadUncompressed(resource, options.flipVertically) &&
+        !loadWithStb(resource, options.flipVertically, error))
         return false;
+    if (options.generateMipmaps)
+        generateMipmaps();
+    encodeBlocks(options.blockFormats);
+    return true;
+}
+
+std::vector<DecodedImage> Image::decodeFiles(
+    const std::vector<std::string>& paths, const DecodeOptions& options, bool keepData) {
+    std::vector<DecodedImage> results(paths.size());
+    std::vector<std::vector<uint8_t>> contents(paths.size());
+    parallelFor(paths.size(), [&](size_t i) {
+        results[i].path = paths[i];
+        if (readFile(paths[i], contents[i], results[i].error))
+            results[i].contentHash = hashContent(contents[i]);
+    });
+
+    // Decided in the order of "paths" so that the same file is decoded in
+    // every run.
+    // Hashes can collide, so files of the same hash are compared by content.
+    std::multimap<uint64_t, size_t> firstByHash;
+    for (size_t i = 0; i < paths.size(); ++i) {
+        if (!results[i].error.empty())
+            continue;
+        const auto [begin, end] = firstByHash.equal_range(results[i].contentHash);
+        const auto first = std::find_if(begin, end, [&](const auto& entry) {
+            return contents[entry.second] == contents[i];
+        });
+        if (first != end) {
+            results[i].sameAs = first->second;
+            std::vector<uint8_t>().swap(contents[i]);
+        } else {
+            firstByHash.emplace(results[i].contentHash, i);
+        }
     }
 
-    if (comp == 4)
-        hasAlpha = true;
-    else
-        hasAlpha = false;
+    parallelFor(paths.size(), [&](size_t i) {
+        auto& result = results[i];
+        if (!result.error.empty() || result.sameAs)
+            return;
+        Image image;
+        std::string error;
+        if (image.decode({contents[i].data(), contents[i].size()}, options, error))
+            result.image = std::move(image);
+        else
+            result.error = "Failed to decode image: " + paths[i] + ": " + error;
+        if (keepData)
+            result.data = std::move(contents[i]);
+        else
+            std::vector<uint8_t>().swap(contents[i]);
+    });
+    return results;
+}
 
-    uint8_t *const image = stbi_load_from_file(file, &width, &height, &comp, STBI_rgb_alpha);
-    dataSize = width * height * 4;
+bool Image::loadUncompressed(const Resource::View& resource, bool flipVertically) {
+    auto layout = parseBMP(resource.data(), resource.length());
+    const bool bmp = layout.has_value();
+    if (!bmp)
+        layout = parseTGA(resource.data(), resource.length());
+    if (!layout)
+        return false;
+
+    width = layout->width;
+    height = layout->height;
+    hasAlpha = layout->bytesPerPixel == 4;
+    dataSize = static_cast<size_t>(width) * height * 4;
     pixels.resize(dataSize);
-    std::copy(image, image + dataSize, pixels.data());
-    stbi_image_free(image);
 
+    // Bottom-up files are flipped already, and top-down ones are not.
+    const size_t dstPitch = static_cast<size_t>(width) * 4;
+    for (int y = 0; y < height; ++y) {
+        const int srcY = layout->topDown == flipVertically ? height - 1 - y : y;
+        const uint8_t *src = layout->pixels + layout->pitch * srcY;
+        uint8_t *dst = pixels.data() + dstPitch * y;
+        if (hasAlpha)
+            swizzleBGRA(src, dst, width);
+        else
+            swizzleBGR(src, dst, width);
+    }
+
+    // Like stb, regard alpha of 32 bit BMP as unused when it's all 0.
+    if (bmp && hasAlpha) {
+        bool transparent = true;
+        for (size_t i = 3; i < pixels.size() && transparent; i += 4)
+            transparent = pixels[i] == 0;
+        for (size_t i = 3; i < pixels.size() && transparent; i += 4)
+            pixels[i] = 255;
+    }
+    alphaUsage = hasAlpha ? classifyAlpha(pixels) : AlphaUsage::Opaque;
     return true;
 }
 
-bool Image::loadFromMemory(const Resource::View& resource) {
-    stbi_set_flip_vertically_on_load(true);
-
+bool Image::loadWithStb(
+    const Resource::View& resource, bool flipVertically, std::string& error) {
+    // The flip flag of stb is global, which other threads may be decoding with.
+    // Rows are flipped here instead.
     int comp = 0;
     const int ret =
         stbi_info_from_memory(resource.data(), resource.length(), &width, &height, &comp);
     if (ret == 0) {
-        Err::Log("Failed to read info:", __func__, ':', stbi_failure_reason());
+        error = stbi_failure_reason();
         return false;
     }
 
@@ -127,10 +541,235 @@ bool Image::loadFromMemory(const Resource::View& resource) {
 
     uint8_t *const image = stbi_load_from_memory(
         resource.data(), resource.length(), &width, &height, &comp, STBI_rgb_alpha);
-    dataSize = width * height * 4;
+    if (!image) {
+        error = stbi_failure_reason();
+        return false;
+    }
+    dataSize = static_cast<size_t>(width) * height * 4;
     pixels.resize(dataSize);
-    std::copy(image, image + dataSize, pixels.data());
+    const size_t pitch = static_cast<size_t>(width) * 4;
+    for (int y = 0; y < height; ++y) {
+        const uint8_t *src = image + pitch * (flipVertically ? height - 1 - y : y);
+        std::copy(src, src + pitch, pixels.data() + pitch * y);
+    }
     stbi_image_free(image);
+    alphaUsage = hasAlpha ? classifyAlpha(pixels) : AlphaUsage::Opaque;
 
     return true;
 }
+
+bool Image::readFile(const std::string_view path, std::vector<uint8_t>& data) {
+    std::string error;
+    if (!readFile(path, data, error)) {
+        Err::Log(error);
+        return false;
+    }
+    return true;
+}
+
+bool Image::readFile(
+    const std::string_view path, std::vector<uint8_t>& data, std::string& error) {
+    File file(path);
+    if (!file) {
+        error = "Failed to open file: " + std::string(path);
+        return false;
+    }
+
+    long size = -1;
+    if (std::fseek(file, 0, SEEK_END) == 0)
+        size = std::ftell(file);
+    if (size < 0 || std::fseek(file, 0, SEEK_SET) != 0) {
+        error = "Failed to read file: " + std::string(path);
+        return false;
+    }
+    data.resize(size);
+    if (std::fread(data.data(), 1, data.size(), file) != data.size()) {
+        error = "Failed to read file: " + std::string(path);
+        return false;
+    }
+    return true;
+}
+
+bool Image::hasContent(const std::string_view path, const std::vector<uint8_t>& data) {
+    std::vector<uint8_t> content;
+    std::string error;
+    return readFile(path, content, error) && content == data;
+}
+
+uint64_t Image::hashContent(const std::vector<uint8_t>& data) {
+    // Mixes 8 bytes at a time in 4 independent lanes, in the way of xxHash64,
+    // which hashes far faster than the files are decoded.
+    constexpr uint64_t prime1 = 0x9e3779b185ebca87;
+    constexpr uint64_t prime2 = 0xc2b2ae3d27d4eb4f;
+    const auto round = [](uint64_t acc, uint64_t input) {
+        return std::rotl(acc + input * prime2, 31) * prime1;
+    };
+
+    std::array<uint64_t, 4> lanes = {prime1 + prime2, prime2, 0, 0 - prime1};
+    size_t i = 0;
+    for (; i + 32 <= data.size(); i += 32) {
+        for (size_t lane = 0; lane < lanes.size(); ++lane) {
+            uint64_t word;
+            std::memcpy(&word, data.data() + i + lane * 8, 8);
+            lanes[lane] = round(lanes[lane], word);
+        }
+    }
+
+    uint64_t hash = data.size();
+    for (size_t lane = 0; lane < lanes.size(); ++lane)
+        hash = round(hash ^ std::rotl(lanes[lane], 1 + lane * 6), prime1);
+    for (; i < data.size(); ++i)
+        hash = round(hash, data[i]);
+
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    hash *= prime1;
+    return hash ^ (hash >> 32);
+}
+
+void Image::loadFromToon(const Resource::Toon& toon) {
+    width = toon.width;
+    height = toon.height;
+    dataSize = toon.pixels.length();
+    pixels.assign(toon.pixels.data(), toon.pixels.data() + dataSize);
+    alphaUsage = classifyAlpha(pixels);
+    hasAlpha = alphaUsage != AlphaUsage::Opaque;
+}
+
+void Image::generateMipmaps() {
+    mipmaps.clear();
+
+    // Translucent alpha of blended images is averaged as it is, while alpha
+    // of cutout images is rescaled to keep the coverage by the cutoff.
+    const float coverage =
+        alphaUsage == AlphaUsage::Cutout ? computeAlphaCoverage(pixels) : 0.0f;
+    int w = width;
+    int h = height;
+    while (w > 1 || h > 1) {
+        const int dw = std::max(w / 2, 1);
+        const int dh = std::max(h / 2, 1);
+        const auto& src = mipmaps.empty() ? pixels : mipmaps.back();
+        std::vector<uint8_t> dst(static_cast<size_t>(dw) * dh * 4);
+        downsample(src.data(), w, h, dst.data(), dw, dh);
+        if (coverage > 0.0f)
+            scaleAlphaCoverage(dst, coverage);
+        mipmaps.push_back(std::move(dst));
+        w = dw;
+        h = dh;
+    }
+}
+
+std::optional<BCn::Format> Image::selectBlockFormat(
+    const BlockFormats& formats, AlphaUsage alphaUsage, int width, int height) {
+    if (width % 4 != 0 || height % 4 != 0)
+        return std::nullopt;
+    return alphaUsage == AlphaUsage::Opaque ? formats.opaque : formats.alpha;
+}
+
+void Image::encodeBlocks(const BlockFormats& formats) {
+    blocks.clear();
+    blockPSNR = 0.0;
+    blockFormat = selectBlockFormat(formats, alphaUsage, width, height);
+    if (!blockFormat)
+        return;
+
+    blocks.reserve(mipmaps.size() + 1);
+    blocks.push_back(BCn::Encode(*blockFormat, pixels.data(), width, height));
+    for (size_t level = 1; level <= mipmaps.size(); ++level) {
+        blocks.push_back(BCn::Encode(
+            *blockFormat, mipmaps[level - 1].data(), std::max(width >> level, 1),
+            std::max(height >> level, 1)));
+    }
+    if (formats.measurePSNR) {
+        const auto decoded = BCn::Decode(*blockFormat, blocks.front().data(), width, height);
+        blockPSNR = BCn::ComputePSNR(pixels, decoded);
+    }
+}
+
+void Image::encodeBlocks(const std::vector<Image *>& images, const BlockFormats& formats) {
+    parallelFor(images.size(), [&](size_t i) { images[i]->encodeBlocks(formats); });
+}
+
+void Image::shrinkToLevel(size_t level) {
+    if (level == 0 || level > mipmaps.size())
+        return;
+    pixels = std::move(mipmaps[level - 1]);
+    mipmaps.erase(mipmaps.begin(), mipmaps.begin() + level);
+    if (!blocks.empty())
+        blocks.erase(blocks.begin(), blocks.begin() + level);
+    width = std::max(width >> level, 1);
+    height = std::max(height >> level, 1);
+    dataSize = pixels.size();
+}
+
+std::optional<Image::DecoderComparison> Image::compareDecoders(
+    const Resource::View& resource) {
+    Image image;
+    bool supported = true;
+    const double uncompressedMs =
+        Benchmark::MeasureMs([&]() { supported = image.loadUncompressed(resource, true); });
+    if (!supported)
+        return std::nullopt;
+    std::string error;
+    const double stbMs =
+        Benchmark::MeasureMs([&]() { image.loadWithStb(resource, true, error); });
+    return DecoderComparison{.uncompressedMs = uncompressedMs, .stbMs = stbMs};
+}
+
+ImageStreamer::ImageStreamer() : nextJob_(0), polledCount_(0) {}
+
+ImageStreamer::~ImageStreamer() {
+    Stop();
+}
+
+void ImageStreamer::Start(std::vector<Job> jobs, const DecodeOptions& options) {
+    Stop();
+    jobs_ = std::move(jobs);
+    options_ = options;
+    nextJob_ = 0;
+    polledCount_ = 0;
+    finished_.clear();
+
+    // Leave a core for the main thread, which keeps drawing frames meanwhile.
+    const unsigned int cores = std::thread::hardware_concurrency();
+    const size_t threadCount = std::min<size_t>(jobs_.size(), std::max(cores, 2u) - 1);
+    for (size_t i = 0; i < threadCount; ++i)
+        workers_.emplace_back([this]() { work(); });
+}
+
+void ImageStreamer::Stop() {
+    nextJob_ = jobs_.size();
+    for (auto& worker : workers_)
+        worker.join();
+    workers_.clear();
+    jobs_.clear();
+}
+
+bool ImageStreamer::Poll(std::vector<DecodedImage>& decoded) {
+    {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& image : finished_)
+            decoded.push_back(std::move(image));
+        polledCount_ += finished_.size();
+        finished_.clear();
+    }
+    return polledCount_ < jobs_.size();
+}
+
+void ImageStreamer::work() {
+    for (size_t i = nextJob_++; i < jobs_.size(); i = nextJob_++) {
+        auto& job = jobs_[i];
+        DecodedImage decoded{.path = job.path};
+        Image image;
+        std::string error;
+        if (image.decode({job.data.data(), job.data.size()}, options_, error))
+            decoded.image = std::move(image);
+        else
+            decoded.error = "Failed to decode image: " + job.path + ": " + error;
+        std::vector<uint8_t>().swap(job.data);
+
+        const std::lock_guard<std::mutex> lock(mutex_);
+        finished_.push_back(std::move(decoded));
+    }
+}
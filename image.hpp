@@ -1,25 +1,167 @@
 #ifndef IMAGE_HPP_
 #define IMAGE_HPP_
 
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
+#include "bcn.hpp"
 #include "resources.hpp"
 #include "util.hpp"
 
+// How pixels of an image use alpha.
+enum class AlphaUsage {
+    Opaque,   // All the pixels are opaque.
+    Cutout,   // Pixels are either opaque or fully transparent.
+    Blended,  // Some pixels are translucent.
+    Count,
+};
+
+// Block compressed formats to encode images into by whether they use alpha,
+// or std::nullopt to leave them uncompressed.  Whether the backend samples a
+// format is asked on the main thread, so this is decided there beforehand.
+struct BlockFormats {
+    std::optional<BCn::Format> opaque;
+    std::optional<BCn::Format> alpha;
+    bool measurePSNR = false;  // Whether to measure Image::blockPSNR.
+};
+
+struct DecodeOptions {
+    bool flipVertically = true;  // Store rows from the bottom as textures are sampled.
+    bool generateMipmaps = false;
+    BlockFormats blockFormats;  // Encoded after generating mipmaps.
+};
+
+struct DecodedImage;
+
 class Image : private NonCopyable {
 public:
+    struct DecoderComparison {
+        double uncompressedMs;
+        double stbMs;
+    };
+
     std::vector<uint8_t> pixels;
     int width;
     int height;
     size_t dataSize;
-    bool hasAlpha;
+    bool hasAlpha;  // Whether the file has an alpha channel.
+    AlphaUsage alphaUsage;
+    std::vector<std::vector<uint8_t>> mipmaps;  // Mip levels from 1.
+    std::optional<BCn::Format> blockFormat;     // Set when encoded by encodeBlocks().
+    std::vector<std::vector<uint8_t>> blocks;   // Encoded mip levels from 0.
+    double blockPSNR;  // Of the encoded level 0 in dB, when measured.
 
     Image();
     Image(Image&& image);
     Image& operator=(Image&& rhs);
-    bool loadFromFile(const std::string_view path);
     bool loadFromMemory(const Resource::View& resource);
+    void loadFromToon(const Resource::Toon& toon);
+
+    // Decode "resource" like loadFromMemory(), but store the reason into
+    // "error" instead of showing it on failure.  Images can be decoded by this
+    // on several threads at a time.
+    bool decode(
+        const Resource::View& resource, const DecodeOptions& options, std::string& error);
+
+    // Read and decode the files of "paths" on a few threads.  Results are in
+    // the order of "paths" whatever order the files are decoded in.  A file of
+    // the same content as an earlier one is not decoded but refers to it.  The
+    // contents of decoded files are handed back in DecodedImage::data when
+    // "keepData" is true.
+    static std::vector<DecodedImage> decodeFiles(
+        const std::vector<std::string>& paths, const DecodeOptions& options, bool keepData);
+
+    // Read an image file without decoding it, e.g. to find files of the same
+    // content by hashContent() before decoding them.
+    static bool readFile(const std::string_view path, std::vector<uint8_t>& data);
+    static bool readFile(
+        const std::string_view path, std::vector<uint8_t>& data, std::string& error);
+    static uint64_t hashContent(const std::vector<uint8_t>& data);
+
+    // Whether the file of "path" holds "data", to tell apart files whose
+    // hashContent() collides.
+    static bool hasContent(const std::string_view path, const std::vector<uint8_t>& data);
+
+    // Build the mip chain down to 1x1 from "pixels".  Colors are averaged in
+    // linear space weighted by alpha, and alpha of each level is rescaled to
+    // keep the coverage of level 0 so that alpha-tested parts like hair don't
+    // thin out in distance.
+    void generateMipmaps();
+
+    // The format of "formats" for an image of "alphaUsage" and the size, or
+    // std::nullopt for images not aligned to blocks, which some backends
+    // reject.
+    static std::optional<BCn::Format> selectBlockFormat(
+        const BlockFormats& formats, AlphaUsage alphaUsage, int width, int height);
+
+    // Encode the image and its mip levels into the format selected by
+    // selectBlockFormat(), if any.
+    void encodeBlocks(const BlockFormats& formats);
+
+    // encodeBlocks() "images" on a few threads.
+    static void encodeBlocks(const std::vector<Image *>& images, const BlockFormats& formats);
+
+    // Make mip level "level" the base image and drop the larger levels.  This
+    // downscales the image by a power of 2 without filtering it again.
+    void shrinkToLevel(size_t level);
+
+    // Decode "resource" by the dedicated decoder of uncompressed BMP and TGA
+    // and by stb each to compare their speed.  Returns std::nullopt if the
+    // dedicated decoder doesn't support the image.
+    static std::optional<DecoderComparison> compareDecoders(const Resource::View& resource);
+
+private:
+    // Decode uncompressed 24 or 32 bit BMP and TGA images without stb.  Returns
+    // false for the other images.
+    bool loadUncompressed(const Resource::View& resource, bool flipVertically);
+    bool loadWithStb(const Resource::View& resource, bool flipVertically, std::string& error);
+};
+
+struct DecodedImage {
+    std::string path;
+    std::optional<Image> image;  // std::nullopt when failed or "sameAs" is set.
+    uint64_t contentHash = 0;
+    std::optional<size_t> sameAs;  // Index of the earlier file of the same content.
+    std::vector<uint8_t> data;     // Content of the file, when asked to keep it.
+    std::string error;  // Message to show when failed.
+};
+
+// Decodes image files on worker threads, so that the caller can go on, e.g.
+// drawing frames, while they are decoded.  Decoded images are handed over by
+// Poll() in the order they finish.
+class ImageStreamer : private NonCopyable {
+public:
+    struct Job {
+        std::string path;
+        std::vector<uint8_t> data;  // Content of the image file.
+    };
+
+    ImageStreamer();
+    ~ImageStreamer();
+    void Start(std::vector<Job> jobs, const DecodeOptions& options);
+
+    // Wait for the images being decoded and drop the rest of the jobs.
+    void Stop();
+
+    // Move the images decoded since the last call into "decoded".  Never
+    // blocks.  Returns false once all the images are handed over.
+    bool Poll(std::vector<DecodedImage>& decoded);
 
 private:
+    void work();
+
+    std::vector<Job> jobs_;
+    DecodeOptions options_;
+    std::atomic<size_t> nextJob_;
+    size_t polledCount_;
+    std::mutex mutex_;
+    std::vector<DecodedImage> finished_;  // Guarded by mutex_.
+    std::vector<std::thread> workers_;
 };
 
 #endif  // IMAGE_HPP_
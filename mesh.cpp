@@ -0,0 +1,735 @@
+#include "mesh.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <span>
+#include <vector>
+#include "Saba/Model/MMD/MMDMaterial.h"
+#include "Saba/Model/MMD/MMDModel.h"
+#include "Saba/Model/MMD/MMDNode.h"
+#include "Saba/Model/MMD/PMXFile.h"
+#include "glm/glm.hpp"
+#include "glm/gtc/quaternion.hpp"
+#include "morph.hpp"
+#include "util.hpp"
+
+namespace {
+// Vertices deformed at a time.  The weights, the base attributes, the morph
+// offsets and the output of a tile take about 100 bytes per vertex, which
+// keeps a tile well within L2 cache.
+constexpr size_t tileSize = 1024;
+
+constexpr float packedPositionScale = 65535.0f;
+constexpr float packedNormalScale = 32767.0f;
+
+float signNotZero(float v) {
+    return v < 0.0f ? -1.0f : 1.0f;
+}
+
+// Octahedral mapping of unit vectors.
+glm::vec2 encodeOctahedron(const glm::vec3& n) {
+    const float sum = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+    if (sum == 0.0f)
+        return glm::vec2(0.0f);
+    const glm::vec2 p(n.x / sum, n.y / sum);
+    if (n.z >= 0.0f)
+        return p;
+    return glm::vec2(
+        (1.0f - std::abs(p.y)) * signNotZero(p.x), (1.0f - std::abs(p.x)) * signNotZero(p.y));
+}
+
+glm::vec3 decodeOctahedron(const glm::vec2& p) {
+    glm::vec3 n(p.x, p.y, 1.0f - std::abs(p.x) - std::abs(p.y));
+    if (n.z < 0.0f) {
+        n.x = (1.0f - std::abs(p.y)) * signNotZero(p.x);
+        n.y = (1.0f - std::abs(p.x)) * signNotZero(p.y);
+    }
+    return glm::normalize(n);
+}
+}  // namespace
+
+Mesh::Mesh() :
+    enabled_(false),
+    dualQuaternion_(false),
+    model_(nullptr),
+    basePositions_(nullptr),
+    baseNormals_(nullptr),
+    baseUVs_(nullptr),
+    uploadVertexCount_(0),
+    boundsMin_(0.0f),
+    boundsMax_(0.0f),
+    uvChanged_(false),
+    uvInitialized_(false),
+    cacheLimit_(0),
+    cacheStats_({.frames = 0, .bytes = 0, .hits = 0, .misses = 0}) {}
+
+void Mesh::Init(saba::MMDModel& model, const saba::PMXFile *pmx, const MorphSet& morphs) {
+    model_ = &model;
+    nodes_.clear();
+    sdefBones_.clear();
+    weights_.clear();
+    sdefs_.clear();
+    physicsVertices_.clear();
+    vertexRuns_.clear();
+    visibleRanges_.clear();
+    staticRanges_.clear();
+    physicsRanges_.clear();
+    cache_.clear();
+    cacheRanges_.clear();
+    cacheVertices_.clear();
+
+    auto nodeManager = model.GetNodeManager();
+    const size_t nodeCount = nodeManager->GetNodeCount();
+    const size_t vertexCount = model.GetVertexCount();
+    basePositions_ = model.GetPositions();
+    baseNormals_ = model.GetNormals();
+    baseUVs_ = model.GetUVs();
+    uploadVertexCount_ = vertexCount;
+    vertices_.resize(vertexCount);
+    for (size_t i = 0; i < vertexCount; ++i)
+        vertices_[i] = {.position = basePositions_[i], .normal = baseNormals_[i]};
+    updateBounds();
+
+    enabled_ = pmx && morphs.IsEnabled() && pmx->m_vertices.size() == vertexCount &&
+               pmx->m_bones.size() == nodeCount && nodeCount != 0;
+    if (!enabled_)
+        return;
+
+    for (size_t i = 0; i < nodeCount; ++i)
+        nodes_.push_back(nodeManager->GetMMDNode(i));
+    sdefBones_.assign(nodeCount, false);
+
+    // Same as the bone weights saba::PMXModel::Load() makes.
+    const auto toBone = [nodeCount](int32_t index) -> uint32_t {
+        return index >= 0 && static_cast<size_t>(index) < nodeCount ? index : 0;
+    };
+    weights_.reserve(vertexCount);
+    for (const auto& v : pmx->m_vertices) {
+        VertexWeight weight = {
+            .bones = {0, 0, 0, 0},
+            .weights = {0, 0, 0, 0},
+            .skinning = Skinning::BDEF4,
+            .sdef = 0,
+        };
+        for (int i = 0; i < 4; ++i) {
+            weight.bones[i] = toBone(v.m_boneIndices[i]);
+            weight.weights[i] = v.m_boneIndices[i] >= 0 ? v.m_boneWeights[i] : 0.0f;
+        }
+
+        switch (v.m_weightType) {
+        case saba::PMXVertexWeight::BDEF1:
+            weight.skinning = Skinning::BDEF1;
+            break;
+        case saba::PMXVertexWeight::BDEF2:
+            weight.skinning = Skinning::BDEF2;
+            weight.weights[1] = 1.0f - weight.weights[0];
+            break;
+        case saba::PMXVertexWeight::BDEF4:
+            weight.skinning = Skinning::BDEF4;
+            break;
+        case saba::PMXVertexWeight::SDEF: {
+            weight.skinning = Skinning::SDEF;
+            weight.weights[1] = 1.0f - weight.weights[0];
+            const float w0 = weight.weights[0];
+            const float w1 = weight.weights[1];
+            const glm::vec3 center = v.m_sdefC * glm::vec3(1, 1, -1);
+            glm::vec3 r0 = v.m_sdefR0 * glm::vec3(1, 1, -1);
+            glm::vec3 r1 = v.m_sdefR1 * glm::vec3(1, 1, -1);
+            const glm::vec3 rw = r0 * w0 + r1 * w1;
+            r0 = center + r0 - rw;
+            r1 = center + r1 - rw;
+            weight.sdef = sdefs_.size();
+            sdefs_.push_back({
+                .center = center,
+                .r0 = (center + r0) * 0.5f,
+                .r1 = (center + r1) * 0.5f,
+            });
+            sdefBones_[weight.bones[0]] = true;
+            sdefBones_[weight.bones[1]] = true;
+            break;
+        }
+        case saba::PMXVertexWeight::QDEF:
+            weight.skinning = Skinning::QDEF;
+            break;
+        }
+        weights_.push_back(weight);
+    }
+
+    initPhysicsVertices(*pmx);
+    initVertexRuns(model);
+    visibleRanges_.reserve(vertexRuns_.size());
+    staticRanges_.reserve(vertexRuns_.size());
+    physicsRanges_.reserve(vertexRuns_.size());
+    transforms_.resize(nodeCount);
+    rotations_.resize(nodeCount);
+    dualQuats_.resize(nodeCount);
+    tileOffsets_.resize(tileSize);
+    uvs_.assign(baseUVs_, baseUVs_ + vertexCount);
+    uvInitialized_ = false;
+}
+
+void Mesh::Update(
+    saba::MMDModel& model,
+    MorphSet& morphs,
+    const std::optional<FrameKey>& key) {
+    if (!enabled_) {
+        model.Update();
+        const glm::vec3 *positions = model.GetUpdatePositions();
+        const glm::vec3 *normals = model.GetUpdateNormals();
+        for (size_t i = 0; i < vertices_.size(); ++i)
+            vertices_[i] = {.position = positions[i], .normal = normals[i]};
+        updateBounds();
+        return;
+    }
+
+    updatePalette();
+    updateVisibleRanges(morphs.GetMaterials());
+    glm::vec3 boundsMin(std::numeric_limits<float>::max());
+    glm::vec3 boundsMax(std::numeric_limits<float>::lowest());
+    const bool cacheable = key && IsCacheEnabled();
+    if (cacheable && restoreFrame(*key, boundsMin, boundsMax)) {
+        ++cacheStats_.hits;
+        deform(physicsRanges_, morphs, boundsMin, boundsMax);
+    } else {
+        deform(visibleRanges_, morphs, boundsMin, boundsMax);
+        if (cacheable) {
+            ++cacheStats_.misses;
+            storeFrame(*key);
+        }
+    }
+    if (!visibleRanges_.empty()) {
+        boundsMin_ = boundsMin;
+        boundsMax_ = boundsMax;
+    }
+
+    const glm::vec2 *uvOffsets = morphs.GetUVOffsets();
+    const auto& uvRanges = morphs.GetUVDirtyRanges();
+    uvChanged_ = !uvInitialized_ || !uvRanges.empty();
+    uvInitialized_ = true;
+    for (const auto& range : uvRanges) {
+        for (uint32_t i = range.begin; i < range.end; ++i)
+            uvs_[i] = baseUVs_[i] + uvOffsets[i];
+    }
+    morphs.ClearUVDirtyRanges();
+}
+
+const Mesh::Vertex *Mesh::GetVertices() const {
+    return vertices_.data();
+}
+
+void Mesh::InitCache(const std::vector<uint32_t>& frameCounts, size_t maxBytes) {
+    cache_.clear();
+    size_t totalFrames = 0;
+    for (const uint32_t frameCount : frameCounts) {
+        cache_.emplace_back(frameCount, CachedFrame{.stored = false});
+        totalFrames += frameCount;
+    }
+
+    // No more than all the frames take, nor than the limit allows.
+    const size_t rangeCount = std::min(
+        totalFrames * vertexRuns_.size(), maxBytes / sizeof(MorphSet::Range));
+    const size_t vertexCount =
+        std::min(totalFrames * vertices_.size(), maxBytes / sizeof(PackedVertex));
+    cacheRanges_.clear();
+    cacheRanges_.reserve(rangeCount);
+    cacheVertices_.clear();
+    cacheVertices_.reserve(vertexCount);
+    cacheLimit_ = maxBytes;
+    cacheStats_ = {.frames = 0, .bytes = 0, .hits = 0, .misses = 0};
+}
+
+bool Mesh::IsCacheEnabled() const {
+    return enabled_ && cacheLimit_ != 0;
+}
+
+Mesh::CacheStats Mesh::GetCacheStats() const {
+    return cacheStats_;
+}
+
+void Mesh::ResetCacheStats() {
+    cacheStats_.hits = 0;
+    cacheStats_.misses = 0;
+}
+
+size_t Mesh::GetUploadVertexCount() const {
+    return uploadVertexCount_;
+}
+
+const glm::vec2 *Mesh::GetUVs() const {
+    return enabled_ ? uvs_.data() : model_->GetUpdateUVs();
+}
+
+const glm::vec3& Mesh::GetBoundsMin() const {
+    return boundsMin_;
+}
+
+const glm::vec3& Mesh::GetBoundsMax() const {
+    return boundsMax_;
+}
+
+void Mesh::SetDualQuaternion(bool enabled) {
+    dualQuaternion_ = enabled;
+}
+
+std::optional<Mesh::SkinningComparison> Mesh::CompareSkinning(const MorphSet& morphs) {
+    if (!enabled_)
+        return std::nullopt;
+    updateVisibleRanges(morphs.GetMaterials());
+    if (visibleRanges_.empty())
+        return std::nullopt;
+
+    // Both the palettes are needed whichever method is selected.
+    updatePalette();
+    if (!dualQuaternion_) {
+        for (size_t i = 0; i < nodes_.size(); ++i)
+            dualQuats_[i] = toDualQuat(transforms_[i]);
+    }
+
+    std::vector<Vertex> linear(vertices_.size());
+    std::vector<Vertex> dualQuat(vertices_.size());
+    const auto measure = [this](std::vector<Vertex>& out, auto skin) {
+        return Benchmark::MeasureMs([&]() {
+            for (const auto& range : visibleRanges_) {
+                for (uint32_t i = range.begin; i < range.end; ++i)
+                    out[i] = (this->*skin)(i, basePositions_[i]);
+            }
+        });
+    };
+    SkinningComparison comparison = {
+        .linearMs = measure(linear, &Mesh::skinLinear),
+        .dualQuaternionMs = measure(dualQuat, &Mesh::skinDualQuat),
+        .maxError = 0.0f,
+        .meanError = 0.0f,
+    };
+
+    double errorSum = 0.0;
+    size_t count = 0;
+    for (const auto& range : visibleRanges_) {
+        for (uint32_t i = range.begin; i < range.end; ++i) {
+            const float error = glm::distance(linear[i].position, dualQuat[i].position);
+            comparison.maxError = std::max(comparison.maxError, error);
+            errorSum += error;
+            ++count;
+        }
+    }
+    comparison.meanError = static_cast<float>(errorSum / count);
+    return comparison;
+}
+
+bool Mesh::IsUVChanged() const {
+    return !enabled_ || uvChanged_;
+}
+
+int Mesh::getBoneCount(Skinning skinning) {
+    switch (skinning) {
+    case Skinning::BDEF1:
+        return 1;
+    case Skinning::BDEF2:
+    case Skinning::SDEF:
+        return 2;
+    case Skinning::BDEF4:
+    case Skinning::QDEF:
+        return 4;
+    }
+    return 4;
+}
+
+// Bones are moved by physics when rigid bodies drive them, or when they
+// follow such bones through parents, append transform or IK.  Bones deformed
+// after physics are assumed to be moved by it.
+void Mesh::initPhysicsVertices(const saba::PMXFile& pmx) {
+    const auto& bones = pmx.m_bones;
+    const auto isBone = [&bones](int32_t index) {
+        return index >= 0 && static_cast<size_t>(index) < bones.size();
+    };
+    const auto hasFlag = [](const saba::PMXBone& bone, saba::PMXBoneFlags flag) {
+        return (static_cast<uint16_t>(bone.m_boneFlag) & static_cast<uint16_t>(flag)) != 0;
+    };
+
+    std::vector<uint8_t> moved(bones.size(), false);
+    for (const auto& rb : pmx.m_rigidbodies) {
+        if (rb.m_op != saba::PMXRigidbody::Operation::Static && isBone(rb.m_boneIndex))
+            moved[rb.m_boneIndex] = true;
+    }
+
+    // Bones can depend on bones after them, so repeat until nothing changes.
+    for (bool changed = true; changed;) {
+        changed = false;
+        const auto mark = [&moved, &changed](size_t index) {
+            if (!moved[index]) {
+                moved[index] = true;
+                changed = true;
+            }
+        };
+        for (size_t i = 0; i < bones.size(); ++i) {
+            const auto& bone = bones[i];
+            const bool append = hasFlag(bone, saba::PMXBoneFlags::AppendRotate) ||
+                                hasFlag(bone, saba::PMXBoneFlags::AppendTranslate);
+            if (hasFlag(bone, saba::PMXBoneFlags::DeformAfterPhysics) ||
+                (isBone(bone.m_parentBoneIndex) && moved[bone.m_parentBoneIndex]) ||
+                (append && isBone(bone.m_appendBoneIndex) && moved[bone.m_appendBoneIndex]))
+                mark(i);
+            if (hasFlag(bone, saba::PMXBoneFlags::IK) &&
+                (moved[i] || (isBone(bone.m_ikTargetBoneIndex) &&
+                              moved[bone.m_ikTargetBoneIndex]))) {
+                for (const auto& link : bone.m_ikLinks) {
+                    if (isBone(link.m_ikBoneIndex))
+                        mark(link.m_ikBoneIndex);
+                }
+            }
+        }
+    }
+
+    physicsVertices_.resize(weights_.size());
+    for (size_t i = 0; i < weights_.size(); ++i) {
+        const auto& weight = weights_[i];
+        bool physics = false;
+        for (int b = 0; b < getBoneCount(weight.skinning); ++b)
+            physics = physics || (weight.weights[b] != 0.0f && moved[weight.bones[b]]);
+        physicsVertices_[i] = physics;
+    }
+}
+
+void Mesh::initVertexRuns(const saba::MMDModel& model) {
+    std::vector<int32_t> owners(vertices_.size(), unusedVertices);
+    const auto markOwners = [&model, &owners](const auto *indices) {
+        const size_t subMeshCount = model.GetSubMeshCount();
+        for (size_t i = 0; i < subMeshCount; ++i) {
+            const auto& subMesh = model.GetSubMeshes()[i];
+            for (int j = 0; j < subMesh.m_vertexCount; ++j) {
+                const size_t index = indices[subMesh.m_beginIndex + j];
+                if (index >= owners.size())
+                    continue;
+                int32_t& owner = owners[index];
+                if (owner == unusedVertices)
+                    owner = subMesh.m_materialID;
+                else if (owner != subMesh.m_materialID)
+                    owner = sharedVertices;
+            }
+        }
+    };
+    switch (model.GetIndexElementSize()) {
+    case 1:
+        markOwners(static_cast<const uint8_t *>(model.GetIndices()));
+        break;
+    case 2:
+        markOwners(static_cast<const uint16_t *>(model.GetIndices()));
+        break;
+    case 4:
+        markOwners(static_cast<const uint32_t *>(model.GetIndices()));
+        break;
+    default:
+        // Unknown indices; treat every vertex as visible.
+        owners.assign(owners.size(), sharedVertices);
+        break;
+    }
+
+    for (uint32_t i = 0; i < owners.size(); ++i) {
+        const bool physics = physicsVertices_[i];
+        if (!vertexRuns_.empty() && vertexRuns_.back().material == owners[i] &&
+            vertexRuns_.back().physics == physics) {
+            ++vertexRuns_.back().end;
+        } else {
+            vertexRuns_.push_back({
+                .begin = i,
+                .end = i + 1,
+                .material = owners[i],
+                .physics = physics,
+            });
+        }
+    }
+}
+
+// Same condition as Routine::Draw() skips materials with.
+void Mesh::updateVisibleRanges(const saba::MMDMaterial *materials) {
+    const auto append = [](std::vector<MorphSet::Range>& ranges, const VertexRun& run) {
+        if (!ranges.empty() && ranges.back().end == run.begin)
+            ranges.back().end = run.end;
+        else
+            ranges.push_back({.begin = run.begin, .end = run.end});
+    };
+    visibleRanges_.clear();
+    staticRanges_.clear();
+    physicsRanges_.clear();
+    for (const auto& run : vertexRuns_) {
+        const bool visible = run.material == sharedVertices ||
+                             (run.material >= 0 && materials[run.material].m_alpha != 0);
+        if (!visible)
+            continue;
+        append(visibleRanges_, run);
+        append(run.physics ? physicsRanges_ : staticRanges_, run);
+    }
+    uploadVertexCount_ = visibleRanges_.empty() ? 0 : visibleRanges_.back().end;
+}
+
+Mesh::DualQuat Mesh::toDualQuat(const glm::mat4& m) {
+    const glm::quat real = glm::normalize(glm::quat_cast(m));
+    const glm::vec3 t(m[3]);
+    return {.real = real, .dual = glm::quat(0, t.x, t.y, t.z) * real * 0.5f};
+}
+
+glm::mat4 Mesh::toMatrix(const DualQuat& dq) {
+    const float length = glm::length(dq.real);
+    const glm::quat real = dq.real / length;
+    const glm::quat dual = dq.dual / length;
+    const glm::quat t = dual * glm::conjugate(real) * 2.0f;
+    glm::mat4 m = glm::mat4_cast(real);
+    m[3] = glm::vec4(t.x, t.y, t.z, 1.0f);
+    return m;
+}
+
+void Mesh::updatePalette() {
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+        const auto node = nodes_[i];
+        transforms_[i] = node->GetGlobalTransform() * node->GetInverseInitTransform();
+        if (sdefBones_[i])
+            rotations_[i] = glm::quat_cast(node->GetGlobalTransform());
+        if (dualQuaternion_)
+            dualQuats_[i] = toDualQuat(transforms_[i]);
+    }
+}
+
+Mesh::Vertex Mesh::skin(size_t index, const glm::vec3& position) const {
+    return dualQuaternion_ ? skinDualQuat(index, position) : skinLinear(index, position);
+}
+
+// Same as saba::PMXModel::Update().
+Mesh::Vertex Mesh::skinLinear(size_t index, const glm::vec3& position) const {
+    const auto& weight = weights_[index];
+    const auto& bones = weight.bones;
+    const auto& w = weight.weights;
+    const glm::vec3& normal = baseNormals_[index];
+
+    glm::mat4 m;
+    switch (weight.skinning) {
+    case Skinning::BDEF1:
+        m = transforms_[bones[0]];
+        break;
+    case Skinning::BDEF2:
+        m = transforms_[bones[0]] * w[0] + transforms_[bones[1]] * w[1];
+        break;
+    case Skinning::BDEF4:
+        m = transforms_[bones[0]] * w[0] + transforms_[bones[1]] * w[1] +
+            transforms_[bones[2]] * w[2] + transforms_[bones[3]] * w[3];
+        break;
+    case Skinning::SDEF: {
+        const auto& sdef = sdefs_[weight.sdef];
+        const glm::mat3 rotation =
+            glm::mat3_cast(glm::slerp(rotations_[bones[0]], rotations_[bones[1]], w[1]));
+        const glm::vec3 p0(transforms_[bones[0]] * glm::vec4(sdef.r0, 1));
+        const glm::vec3 p1(transforms_[bones[1]] * glm::vec4(sdef.r1, 1));
+        return {
+            .position = rotation * (position - sdef.center) + p0 * w[0] + p1 * w[1],
+            .normal = rotation * normal,
+        };
+    }
+    case Skinning::QDEF: {
+        std::array<DualQuat, 4> dqs;
+        std::array<float, 4> dqWeights = w;
+        for (int b = 0; b < 4; ++b)
+            dqs[b] = toDualQuat(transforms_[bones[b]]);
+        DualQuat blend = {.real = dqs[0].real * w[0], .dual = dqs[0].dual * w[0]};
+        for (int b = 1; b < 4; ++b) {
+            if (glm::dot(dqs[0].real, dqs[b].real) < 0.0f)
+                dqWeights[b] *= -1.0f;
+            blend.real += dqs[b].real * dqWeights[b];
+            blend.dual += dqs[b].dual * dqWeights[b];
+        }
+        m = toMatrix(blend);
+        break;
+    }
+    }
+    return {
+        .position = glm::vec3(m * glm::vec4(position, 1)),
+        .normal = glm::normalize(glm::mat3(m) * normal),
+    };
+}
+
+// Blend the dual quaternions of the bones in the hemisphere of the first
+// one.
+Mesh::Vertex Mesh::skinDualQuat(size_t index, const glm::vec3& position) const {
+    const auto& weight = weights_[index];
+    const auto& bones = weight.bones;
+    const auto& w = weight.weights;
+
+    const int count = getBoneCount(weight.skinning);
+    const DualQuat& first = dualQuats_[bones[0]];
+    if (count == 1) {
+        const glm::quat t = first.dual * glm::conjugate(first.real) * 2.0f;
+        return {
+            .position = first.real * position + glm::vec3(t.x, t.y, t.z),
+            .normal = first.real * baseNormals_[index],
+        };
+    }
+
+    glm::quat real = first.real * w[0];
+    glm::quat dual = first.dual * w[0];
+    for (int b = 1; b < count; ++b) {
+        const DualQuat& dq = dualQuats_[bones[b]];
+        const float wb = glm::dot(first.real, dq.real) < 0.0f ? -w[b] : w[b];
+        real += dq.real * wb;
+        dual += dq.dual * wb;
+    }
+    const float length = glm::length(real);
+    if (length == 0.0f)
+        return {.position = position, .normal = baseNormals_[index]};
+    real /= length;
+    dual /= length;
+    const glm::quat t = dual * glm::conjugate(real) * 2.0f;
+    return {
+        .position = real * position + glm::vec3(t.x, t.y, t.z),
+        .normal = real * baseNormals_[index],
+    };
+}
+
+// The deltas of each morph are sorted by vertex, so a cursor per morph walks
+// them along with the tiles.  Offsets are summed in the order of the morphs
+// before they are added to the base position, as saba does.
+void Mesh::deform(
+    const std::vector<MorphSet::Range>& ranges,
+    const MorphSet& morphs,
+    glm::vec3& boundsMin,
+    glm::vec3& boundsMax) {
+    const auto& morphDeltas = morphs.GetActivePositionDeltas();
+    morphCursors_.assign(morphDeltas.size(), 0);
+    for (const auto& range : ranges) {
+        for (size_t tileBegin = range.begin; tileBegin < range.end; tileBegin += tileSize) {
+            const size_t tileEnd = std::min<size_t>(tileBegin + tileSize, range.end);
+            bool morphed = false;
+            for (size_t m = 0; m < morphDeltas.size(); ++m) {
+                const auto& deltas = morphDeltas[m];
+                const uint32_t *indicesEnd = deltas.indices + deltas.count;
+                uint32_t& cursor = morphCursors_[m];
+                if (cursor != deltas.count && deltas.indices[cursor] < tileBegin) {
+                    // Skip the deltas of vertices out of the ranges.
+                    cursor = std::lower_bound(
+                                 deltas.indices + cursor, indicesEnd,
+                                 static_cast<uint32_t>(tileBegin)) -
+                             deltas.indices;
+                }
+                if (cursor == deltas.count || deltas.indices[cursor] >= tileEnd)
+                    continue;
+                if (!morphed) {
+                    std::fill_n(tileOffsets_.begin(), tileEnd - tileBegin, glm::vec3(0));
+                    morphed = true;
+                }
+                for (; cursor < deltas.count && deltas.indices[cursor] < tileEnd; ++cursor) {
+                    tileOffsets_[deltas.indices[cursor] - tileBegin] +=
+                        deltas.deltas[cursor] * deltas.weight;
+                }
+            }
+
+            for (size_t i = tileBegin; i < tileEnd; ++i) {
+                glm::vec3 position = basePositions_[i];
+                if (morphed)
+                    position += tileOffsets_[i - tileBegin];
+                vertices_[i] = skin(i, position);
+                boundsMin = glm::min(boundsMin, vertices_[i].position);
+                boundsMax = glm::max(boundsMax, vertices_[i].position);
+            }
+        }
+    }
+}
+
+// Frames stored with other vertices visible are regarded as missing, since
+// the vertices shown now may not be in them.
+bool Mesh::restoreFrame(const FrameKey& key, glm::vec3& boundsMin, glm::vec3& boundsMax) {
+    const auto& frames = cache_[key.motion];
+    if (key.frame >= frames.size())
+        return false;
+    const auto& frame = frames[key.frame];
+    const std::span<const MorphSet::Range> ranges(
+        cacheRanges_.data() + frame.rangeBegin, frame.rangeCount);
+    if (!frame.stored || ranges.size() != staticRanges_.size() ||
+        !std::equal(
+            ranges.begin(), ranges.end(), staticRanges_.begin(),
+            [](const MorphSet::Range& a, const MorphSet::Range& b) {
+                return a.begin == b.begin && a.end == b.end;
+            }))
+        return false;
+
+    const glm::vec3 scale = (frame.boundsMax - frame.boundsMin) / packedPositionScale;
+    const PackedVertex *packed = cacheVertices_.data() + frame.vertexBegin;
+    for (const auto& range : ranges) {
+        for (uint32_t i = range.begin; i < range.end; ++i, ++packed) {
+            const glm::vec3 position(
+                packed->position[0], packed->position[1], packed->position[2]);
+            const glm::vec2 normal(packed->normal[0], packed->normal[1]);
+            vertices_[i] = {
+                .position = frame.boundsMin + position * scale,
+                .normal = decodeOctahedron(normal / packedNormalScale),
+            };
+        }
+    }
+    boundsMin = glm::min(boundsMin, frame.boundsMin);
+    boundsMax = glm::max(boundsMax, frame.boundsMax);
+    return true;
+}
+
+void Mesh::storeFrame(const FrameKey& key) {
+    size_t count = 0;
+    for (const auto& range : staticRanges_)
+        count += range.end - range.begin;
+    const size_t bytes =
+        count * sizeof(PackedVertex) + staticRanges_.size() * sizeof(MorphSet::Range);
+    // Frames past the end of the motion, e.g. after a stall, are not cached.
+    auto& frames = cache_[key.motion];
+    if (count == 0 || key.frame >= frames.size() || frames[key.frame].stored ||
+        cacheStats_.bytes + bytes > cacheLimit_ ||
+        cacheRanges_.size() + staticRanges_.size() > cacheRanges_.capacity() ||
+        cacheVertices_.size() + count > cacheVertices_.capacity())
+        return;
+
+    auto& frame = frames[key.frame];
+    frame.stored = true;
+    frame.rangeBegin = cacheRanges_.size();
+    frame.rangeCount = staticRanges_.size();
+    frame.vertexBegin = cacheVertices_.size();
+    cacheRanges_.insert(cacheRanges_.end(), staticRanges_.begin(), staticRanges_.end());
+    frame.boundsMin = glm::vec3(std::numeric_limits<float>::max());
+    frame.boundsMax = glm::vec3(std::numeric_limits<float>::lowest());
+    for (const auto& range : staticRanges_) {
+        for (uint32_t i = range.begin; i < range.end; ++i) {
+            frame.boundsMin = glm::min(frame.boundsMin, vertices_[i].position);
+            frame.boundsMax = glm::max(frame.boundsMax, vertices_[i].position);
+        }
+    }
+
+    const glm::vec3 extent = frame.boundsMax - frame.boundsMin;
+    const glm::vec3 scale(
+        extent.x > 0.0f ? packedPositionScale / extent.x : 0.0f,
+        extent.y > 0.0f ? packedPositionScale / extent.y : 0.0f,
+        extent.z > 0.0f ? packedPositionScale / extent.z : 0.0f);
+    for (const auto& range : staticRanges_) {
+        for (uint32_t i = range.begin; i < range.end; ++i) {
+            const glm::vec3 position = (vertices_[i].position - frame.boundsMin) * scale;
+            const glm::vec2 normal =
+                encodeOctahedron(vertices_[i].normal) * packedNormalScale;
+            cacheVertices_.push_back({
+                .position =
+                    {static_cast<uint16_t>(std::lround(position.x)),
+                     static_cast<uint16_t>(std::lround(position.y)),
+                     static_cast<uint16_t>(std::lround(position.z))},
+                .normal =
+                    {static_cast<int16_t>(std::lround(normal.x)),
+                     static_cast<int16_t>(std::lround(normal.y))},
+            });
+        }
+    }
+    ++cacheStats_.frames;
+    cacheStats_.bytes += bytes;
+}
+
+void Mesh::updateBounds() {
+    if (vertices_.empty())
+        return;
+    boundsMin_ = boundsMax_ = vertices_[0].position;
+    for (const auto& vertex : vertices_) {
+        boundsMin_ = glm::min(boundsMin_, vertex.position);
+        boundsMax_ = glm::max(boundsMax_, vertex.position);
+    }
+}
@@ -0,0 +1,223 @@
+#ifndef MESH_HPP_
+#define MESH_HPP_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+#include "Saba/Model/MMD/MMDMaterial.h"
+#include "Saba/Model/MMD/MMDModel.h"
+#include "Saba/Model/MMD/MMDNode.h"
+#include "Saba/Model/MMD/PMXFile.h"
+#include "glm/glm.hpp"
+#include "glm/gtc/quaternion.hpp"
+#include "morph.hpp"
+#include "util.hpp"
+
+// Vertices of a PMX model deformed every frame, in place of saba's
+// MMDModel::Update().  Vertices are skinned in the same way as saba, with the
+// position morphs of MorphSet.  Morphing, skinning and the bounding box are
+// done in one pass over tiles of vertices small enough to stay in L2 cache,
+// and the results are written interleaved, as they are uploaded.  Vertices
+// used only by materials hidden with alpha 0 are skipped, as Routine::Draw()
+// doesn't draw them either.
+//
+// Optionally, vertices not moved by physics are cached per frame of motions
+// and restored on later loops of the motions instead of being skinned again.
+class Mesh : private NonCopyable {
+public:
+    struct Vertex {
+        glm::vec3 position;
+        glm::vec3 normal;
+    };
+
+    // Linear skinning and dual quaternion skinning of the same pose.
+    struct SkinningComparison {
+        double linearMs;
+        double dualQuaternionMs;
+        float maxError;  // Distances between the positions by the two.
+        float meanError;
+    };
+
+    // A frame of a motion to cache the vertices of.
+    struct FrameKey {
+        size_t motion;
+        uint32_t frame;  // Index of the frame sampled at Constant::VertexCacheFPS.
+    };
+
+    struct CacheStats {
+        size_t frames;
+        size_t bytes;
+        size_t hits;
+        size_t misses;
+    };
+
+public:
+    Mesh();
+
+    // "pmx" is the file the model is loaded from, or nullptr for PMD models,
+    // which are left to saba.
+    void Init(saba::MMDModel& model, const saba::PMXFile *pmx, const MorphSet& morphs);
+
+    // Replacement of saba::MMDModel::Update().  Consumes the dirty UV ranges
+    // of the morphs.  With "key", the vertices not moved by physics are
+    // restored from the cache of the frame, or stored into it on a miss.  The
+    // vertices must then depend only on the frame, i.e. not be blended with
+    // another motion.
+    void Update(
+        saba::MMDModel& model,
+        MorphSet& morphs,
+        const std::optional<FrameKey>& key = std::nullopt);
+
+    // Enable the cache of vertices for motions of "frameCounts" frames each,
+    // up to "maxBytes" in total.  Frames are cached until the limit and never
+    // evicted.  The storage is allocated here so that storing frames doesn't
+    // touch the heap.
+    void InitCache(const std::vector<uint32_t>& frameCounts, size_t maxBytes);
+    bool IsCacheEnabled() const;
+    CacheStats GetCacheStats() const;
+    void ResetCacheStats();
+
+    // Vertices in the rest pose until the first Update().  Vertices of hidden
+    // materials keep the results of the last frame they were visible in.
+    const Vertex *GetVertices() const;
+
+    // Vertices to upload after the last Update().  The ones after it belong
+    // only to hidden materials.
+    size_t GetUploadVertexCount() const;
+    const glm::vec2 *GetUVs() const;
+
+    // Bounding box of the vertices of the last Update().
+    const glm::vec3& GetBoundsMin() const;
+    const glm::vec3& GetBoundsMax() const;
+
+    // Skin vertices by blending dual quaternions of the bones instead of their
+    // matrices.  This keeps the volume of twisted joints, which is what SDEF
+    // is for, so SDEF vertices are blended the same way as BDEF2.  Scale of
+    // bones is ignored.
+    void SetDualQuaternion(bool enabled);
+
+    // Skin the visible vertices in the current pose by both the methods, and
+    // compare the time they take and the positions, without morphs.  Nothing
+    // is compared for models left to saba.  This allocates two copies of the
+    // vertices, so it's meant to be run at startup.
+    std::optional<SkinningComparison> CompareSkinning(const MorphSet& morphs);
+
+    // Whether the last Update() changed UVs.  UVs change only by UV morphs,
+    // so they needn't be uploaded most of the time.
+    bool IsUVChanged() const;
+
+private:
+    enum class Skinning : uint8_t {
+        BDEF1,
+        BDEF2,
+        BDEF4,
+        SDEF,
+        QDEF,
+    };
+
+    struct VertexWeight {
+        std::array<uint32_t, 4> bones;
+        std::array<float, 4> weights;
+        Skinning skinning;
+        uint32_t sdef;  // Index in sdefs_.
+    };
+
+    // Consecutive vertices used by the same materials.
+    struct VertexRun {
+        uint32_t begin;
+        uint32_t end;
+        int32_t material;  // One of the values below for no or many materials.
+        bool physics;      // Whether moved by physics.
+    };
+    static constexpr int32_t unusedVertices = -1;
+    static constexpr int32_t sharedVertices = -2;
+
+    struct DualQuat {
+        glm::quat real;
+        glm::quat dual;
+    };
+
+    // The parameters of SDEF preprocessed as saba does.
+    struct SDEF {
+        glm::vec3 center;
+        glm::vec3 r0;
+        glm::vec3 r1;
+    };
+
+    // A vertex in 10 bytes.  The position is quantized in the bounding box of
+    // the frame, and the normal is encoded by octahedral mapping.
+    struct PackedVertex {
+        std::array<uint16_t, 3> position;
+        std::array<int16_t, 2> normal;
+    };
+
+    struct CachedFrame {
+        bool stored;
+        // The visible vertices not moved by physics when the frame was stored,
+        // in cacheRanges_, and their vertices in cacheVertices_.
+        size_t rangeBegin;
+        size_t rangeCount;
+        size_t vertexBegin;
+        glm::vec3 boundsMin;
+        glm::vec3 boundsMax;
+    };
+
+    static int getBoneCount(Skinning skinning);
+    void initPhysicsVertices(const saba::PMXFile& pmx);
+    void initVertexRuns(const saba::MMDModel& model);
+    void updateVisibleRanges(const saba::MMDMaterial *materials);
+    static DualQuat toDualQuat(const glm::mat4& m);
+    static glm::mat4 toMatrix(const DualQuat& dq);
+
+    void updatePalette();
+    void deform(
+        const std::vector<MorphSet::Range>& ranges,
+        const MorphSet& morphs,
+        glm::vec3& boundsMin,
+        glm::vec3& boundsMax);
+    bool restoreFrame(const FrameKey& key, glm::vec3& boundsMin, glm::vec3& boundsMax);
+    void storeFrame(const FrameKey& key);
+    Vertex skin(size_t index, const glm::vec3& position) const;
+    Vertex skinLinear(size_t index, const glm::vec3& position) const;
+    Vertex skinDualQuat(size_t index, const glm::vec3& position) const;
+    void updateBounds();
+
+    bool enabled_;
+    bool dualQuaternion_;
+    saba::MMDModel *model_;
+    std::vector<saba::MMDNode *> nodes_;
+    std::vector<uint8_t> sdefBones_;  // Whether bones are used by SDEF.
+    std::vector<VertexWeight> weights_;
+    std::vector<SDEF> sdefs_;
+    std::vector<uint8_t> physicsVertices_;  // Whether vertices are moved by physics.
+    std::vector<VertexRun> vertexRuns_;
+    const glm::vec3 *basePositions_;
+    const glm::vec3 *baseNormals_;
+    const glm::vec2 *baseUVs_;
+
+    std::vector<glm::mat4> transforms_;
+    std::vector<glm::quat> rotations_;
+    std::vector<DualQuat> dualQuats_;  // Of transforms_ in dual quaternion mode.
+    std::vector<MorphSet::Range> visibleRanges_;
+    std::vector<MorphSet::Range> staticRanges_;  // Visible and not moved by physics.
+    std::vector<MorphSet::Range> physicsRanges_;  // Visible and moved by physics.
+    size_t uploadVertexCount_;
+    std::vector<glm::vec3> tileOffsets_;  // Morph offsets of a tile.
+    std::vector<uint32_t> morphCursors_;  // Next delta of each position morph.
+    std::vector<Vertex> vertices_;
+    std::vector<glm::vec2> uvs_;
+    glm::vec3 boundsMin_;
+    glm::vec3 boundsMax_;
+    bool uvChanged_;
+    bool uvInitialized_;  // Whether Update() has reported the initial UVs.
+
+    std::vector<std::vector<CachedFrame>> cache_;  // Indexed by motion and frame.
+    std::vector<MorphSet::Range> cacheRanges_;  // Reserved in InitCache().
+    std::vector<PackedVertex> cacheVertices_;   // Reserved in InitCache().
+    size_t cacheLimit_;
+    CacheStats cacheStats_;
+};
+
+#endif  // MESH_HPP_
@@ -0,0 +1,485 @@
+#include "morph.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "Saba/Model/MMD/MMDMaterial.h"
+#include "Saba/Model/MMD/MMDModel.h"
+#include "Saba/Model/MMD/MMDMorph.h"
+#include "Saba/Model/MMD/MMDNode.h"
+#include "Saba/Model/MMD/PMXFile.h"
+#include "glm/glm.hpp"
+#include "glm/gtc/quaternion.hpp"
+
+namespace {
+// Vertices of a morph closer than this are put in one range.  Keeps the ranges
+// few for morphs scattered over a face.
+constexpr uint32_t rangeGap = 32;
+
+// Sort ranges and merge the overlapping or adjacent ones, in place.
+void mergeRanges(std::vector<MorphSet::Range>& ranges) {
+    if (ranges.empty())
+        return;
+    std::sort(ranges.begin(), ranges.end(), [](const auto& x, const auto& y) {
+        return x.begin < y.begin;
+    });
+    size_t last = 0;
+    for (size_t i = 1; i < ranges.size(); ++i) {
+        if (ranges[i].begin <= ranges[last].end)
+            ranges[last].end = std::max(ranges[last].end, ranges[i].end);
+        else
+            ranges[++last] = ranges[i];
+    }
+    ranges.resize(last + 1);
+}
+
+// Sort the deltas of a morph by vertex index, dropping invalid indices.
+template <typename Delta, typename Element, typename Convert>
+void appendDeltas(
+    const std::vector<Element>& elements,
+    size_t vertexCount,
+    std::vector<uint32_t>& indices,
+    std::vector<Delta>& deltas,
+    Convert convert) {
+    std::vector<std::pair<uint32_t, Delta>> sorted;
+    sorted.reserve(elements.size());
+    for (const auto& element : elements) {
+        if (element.m_vertexIndex < 0 ||
+            static_cast<size_t>(element.m_vertexIndex) >= vertexCount)
+            continue;
+        sorted.emplace_back(element.m_vertexIndex, convert(element));
+    }
+    std::stable_sort(sorted.begin(), sorted.end(), [](const auto& x, const auto& y) {
+        return x.first < y.first;
+    });
+    for (const auto& [index, delta] : sorted) {
+        indices.push_back(index);
+        deltas.push_back(delta);
+    }
+}
+}  // namespace
+
+void MorphSet::MaterialFactor::Mul(const MaterialFactor& factor, float weight) {
+    diffuse = glm::mix(diffuse, diffuse * factor.diffuse, weight);
+    alpha = glm::mix(alpha, alpha * factor.alpha, weight);
+    specular = glm::mix(specular, specular * factor.specular, weight);
+    specularPower = glm::mix(specularPower, specularPower * factor.specularPower, weight);
+    ambient = glm::mix(ambient, ambient * factor.ambient, weight);
+    edgeColor = glm::mix(edgeColor, edgeColor * factor.edgeColor, weight);
+    edgeSize = glm::mix(edgeSize, edgeSize * factor.edgeSize, weight);
+    textureFactor = glm::mix(textureFactor, textureFactor * factor.textureFactor, weight);
+    spTextureFactor =
+        glm::mix(spTextureFactor, spTextureFactor * factor.spTextureFactor, weight);
+    toonTextureFactor =
+        glm::mix(toonTextureFactor, toonTextureFactor * factor.toonTextureFactor, weight);
+}
+
+void MorphSet::MaterialFactor::Add(const MaterialFactor& factor, float weight) {
+    diffuse += factor.diffuse * weight;
+    alpha += factor.alpha * weight;
+    specular += factor.specular * weight;
+    specularPower += factor.specularPower * weight;
+    ambient += factor.ambient * weight;
+    edgeColor += factor.edgeColor * weight;
+    edgeSize += factor.edgeSize * weight;
+    textureFactor += factor.textureFactor * weight;
+    spTextureFactor += factor.spTextureFactor * weight;
+    toonTextureFactor += factor.toonTextureFactor * weight;
+}
+
+MorphSet::MorphSet() : enabled_(false), modelMaterials_(nullptr) {}
+
+void MorphSet::Init(saba::MMDModel& model, const saba::PMXFile *pmx) {
+    morphs_.clear();
+    animated_.clear();
+    positionIndices_.clear();
+    positionDeltas_.clear();
+    uvIndices_.clear();
+    uvDeltas_.clear();
+    uvRanges_.clear();
+    boneMorphs_.clear();
+    materialMorphs_.clear();
+    groupMembers_.clear();
+    active_.clear();
+    lastActive_.clear();
+    positionDeltaList_.clear();
+    uvDirtyRanges_.clear();
+    modelMaterials_ = model.GetMaterials();
+
+    auto morphManager = model.GetMorphManager();
+    const size_t vertexCount = model.GetVertexCount();
+    enabled_ = pmx && morphManager->GetMorphCount() == pmx->m_morphs.size() &&
+               pmx->m_vertices.size() == vertexCount;
+    if (!enabled_)
+        return;
+
+    const size_t materialCount = model.GetMaterialCount();
+    const size_t nodeCount = model.GetNodeManager()->GetNodeCount();
+    const size_t morphCount = pmx->m_morphs.size();
+    for (size_t i = 0; i < morphCount; ++i) {
+        const auto& pmxMorph = pmx->m_morphs[i];
+        Morph morph = {
+            .morph = morphManager->GetMorph(i),
+            .type = Type::None,
+            .dataBegin = 0,
+            .dataEnd = 0,
+            .rangeBegin = 0,
+            .rangeEnd = 0,
+        };
+
+        switch (pmxMorph.m_morphType) {
+        case saba::PMXMorphType::Position:
+            morph.type = Type::Position;
+            morph.dataBegin = positionIndices_.size();
+            appendDeltas(
+                pmxMorph.m_positionMorph, vertexCount, positionIndices_, positionDeltas_,
+                [](const auto& e) { return e.m_position * glm::vec3(1, 1, -1); });
+            morph.dataEnd = positionIndices_.size();
+            break;
+        case saba::PMXMorphType::UV:
+            morph.type = Type::UV;
+            morph.dataBegin = uvIndices_.size();
+            appendDeltas(
+                pmxMorph.m_uvMorph, vertexCount, uvIndices_, uvDeltas_,
+                [](const auto& e) { return glm::vec2(e.m_uv.x, e.m_uv.y); });
+            morph.dataEnd = uvIndices_.size();
+            break;
+        case saba::PMXMorphType::Bone:
+            morph.type = Type::Bone;
+            morph.dataBegin = boneMorphs_.size();
+            for (const auto& e : pmxMorph.m_boneMorph) {
+                if (e.m_boneIndex < 0 || static_cast<size_t>(e.m_boneIndex) >= nodeCount)
+                    continue;
+                // Convert from the left-handed coordinates of MMD.
+                const auto& q = e.m_quaternion;
+                boneMorphs_.push_back({
+                    .node = model.GetNodeManager()->GetMMDNode(e.m_boneIndex),
+                    .translate = e.m_position * glm::vec3(1, 1, -1),
+                    .rotate = glm::quat(q.w, -q.x, -q.y, q.z),
+                });
+            }
+            morph.dataEnd = boneMorphs_.size();
+            break;
+        case saba::PMXMorphType::Material:
+            morph.type = Type::Material;
+            morph.dataBegin = materialMorphs_.size();
+            for (const auto& e : pmxMorph.m_materialMorph) {
+                if (e.m_materialIndex >= 0 &&
+                    static_cast<size_t>(e.m_materialIndex) >= materialCount)
+                    continue;
+                materialMorphs_.push_back({
+                    .material = e.m_materialIndex,
+                    .add = e.m_opType == saba::PMXMorph::MaterialMorph::OpType::Add,
+                    .factor =
+                        {
+                            .diffuse = glm::vec3(e.m_diffuse),
+                            .alpha = e.m_diffuse.w,
+                            .specular = e.m_specular,
+                            .specularPower = e.m_specularPower,
+                            .ambient = e.m_ambient,
+                            .edgeColor = e.m_edgeColor,
+                            .edgeSize = e.m_edgeSize,
+                            .textureFactor = e.m_textureFactor,
+                            .spTextureFactor = e.m_sphereTextureFactor,
+                            .toonTextureFactor = e.m_toonTextureFactor,
+                        },
+                });
+            }
+            morph.dataEnd = materialMorphs_.size();
+            break;
+        case saba::PMXMorphType::Group:
+            // saba doesn't apply groups nested in groups.
+            morph.type = Type::Group;
+            morph.dataBegin = groupMembers_.size();
+            for (const auto& e : pmxMorph.m_groupMorph) {
+                if (e.m_morphIndex < 0 || static_cast<size_t>(e.m_morphIndex) >= morphCount ||
+                    pmx->m_morphs[e.m_morphIndex].m_morphType == saba::PMXMorphType::Group)
+                    continue;
+                groupMembers_.push_back({
+                    .index = static_cast<uint32_t>(e.m_morphIndex),
+                    .weight = e.m_weight,
+                });
+            }
+            morph.dataEnd = groupMembers_.size();
+            break;
+        default:
+            break;
+        }
+        morphs_.push_back(morph);
+    }
+
+    // Vertex ranges of UV morphs.
+    for (auto& morph : morphs_) {
+        if (morph.type != Type::UV)
+            continue;
+        morph.rangeBegin = uvRanges_.size();
+        for (uint32_t i = morph.dataBegin; i < morph.dataEnd; ++i) {
+            const uint32_t index = uvIndices_[i];
+            const bool first = uvRanges_.size() == morph.rangeBegin;
+            if (!first && index <= uvRanges_.back().end + rangeGap)
+                uvRanges_.back().end = std::max(uvRanges_.back().end, index + 1);
+            else
+                uvRanges_.push_back({.begin = index, .end = index + 1});
+        }
+        morph.rangeEnd = uvRanges_.size();
+    }
+
+    // Group members are reached only through the animated groups, so the
+    // active list never needs more entries than this.
+    active_.reserve(morphs_.size() + groupMembers_.size());
+    lastActive_.reserve(active_.capacity());
+    positionDeltaList_.reserve(active_.capacity());
+    uvDirtyRanges_.reserve(uvRanges_.size() * 2);
+
+    uvOffsets_.assign(vertexCount, glm::vec2(0));
+
+    initMaterials_.assign(modelMaterials_, modelMaterials_ + materialCount);
+    materials_ = initMaterials_;
+    mulFactors_.resize(materialCount);
+    addFactors_.resize(materialCount);
+}
+
+void MorphSet::AddAnimatedMorphs(const std::vector<saba::MMDMorph *>& morphs) {
+    if (!enabled_)
+        return;
+
+    std::unordered_map<const saba::MMDMorph *, uint32_t> indices;
+    for (uint32_t i = 0; i < morphs_.size(); ++i)
+        indices.emplace(morphs_[i].morph, i);
+    for (const auto morph : morphs) {
+        if (const auto it = indices.find(morph); it != indices.end())
+            animated_.push_back(it->second);
+    }
+    std::sort(animated_.begin(), animated_.end());
+    animated_.erase(std::unique(animated_.begin(), animated_.end()), animated_.end());
+}
+
+void MorphSet::Update(saba::MMDModel& model) {
+    if (!enabled_) {
+        model.UpdateMorphAnimation();
+        return;
+    }
+
+    gatherActiveMorphs();
+    gatherPositionDeltas();
+    updateUVs();
+    updateBones();
+    updateMaterials();
+}
+
+bool MorphSet::IsEnabled() const {
+    return enabled_;
+}
+
+const saba::MMDMaterial *MorphSet::GetMaterials() const {
+    return enabled_ ? materials_.data() : modelMaterials_;
+}
+
+const std::vector<MorphSet::PositionDeltas>& MorphSet::GetActivePositionDeltas() const {
+    return positionDeltaList_;
+}
+
+const glm::vec2 *MorphSet::GetUVOffsets() const {
+    return uvOffsets_.data();
+}
+
+const std::vector<MorphSet::Range>& MorphSet::GetUVDirtyRanges() const {
+    return uvDirtyRanges_;
+}
+
+const std::vector<uint32_t>& MorphSet::GetUVMorphVertices() const {
+    return uvIndices_;
+}
+
+void MorphSet::ClearUVDirtyRanges() {
+    uvDirtyRanges_.clear();
+}
+
+void MorphSet::gatherActiveMorphs() {
+    // saba applies all the morphs in order, and group morphs apply their
+    // members in place.  Morphs with weight 0 change nothing.
+    std::swap(active_, lastActive_);
+    active_.clear();
+    for (const uint32_t index : animated_) {
+        const auto& morph = morphs_[index];
+        const float weight = morph.morph->GetWeight();
+        if (weight == 0.0f || morph.type == Type::None)
+            continue;
+        if (morph.type != Type::Group) {
+            active_.push_back({.index = index, .weight = weight});
+            continue;
+        }
+        for (uint32_t i = morph.dataBegin; i < morph.dataEnd; ++i) {
+            const auto& member = groupMembers_[i];
+            const float memberWeight = member.weight * weight;
+            if (memberWeight != 0.0f && morphs_[member.index].type != Type::None)
+                active_.push_back({.index = member.index, .weight = memberWeight});
+        }
+    }
+}
+
+void MorphSet::gatherPositionDeltas() {
+    positionDeltaList_.clear();
+    for (const auto& active : active_) {
+        const auto& morph = morphs_[active.index];
+        if (morph.type != Type::Position || morph.dataBegin == morph.dataEnd)
+            continue;
+        positionDeltaList_.push_back({
+            .indices = positionIndices_.data() + morph.dataBegin,
+            .deltas = positionDeltas_.data() + morph.dataBegin,
+            .count = morph.dataEnd - morph.dataBegin,
+            .weight = active.weight,
+        });
+    }
+}
+
+void MorphSet::updateUVs() {
+    // UV morphs are rare in motions.  Leave the offsets as they are unless
+    // the active UV morphs or their weights changed.
+    const auto isUV = [this](const ActiveMorph& active) {
+        return morphs_[active.index].type == Type::UV;
+    };
+    auto last = std::find_if(lastActive_.begin(), lastActive_.end(), isUV);
+    auto current = std::find_if(active_.begin(), active_.end(), isUV);
+    bool changed = false;
+    while (!changed && (last != lastActive_.end() || current != active_.end())) {
+        changed = last == lastActive_.end() || current == active_.end() ||
+                  last->index != current->index || last->weight != current->weight;
+        if (!changed) {
+            last = std::find_if(last + 1, lastActive_.end(), isUV);
+            current = std::find_if(current + 1, active_.end(), isUV);
+        }
+    }
+    if (!changed)
+        return;
+
+    for (const auto& active : lastActive_) {
+        const auto& morph = morphs_[active.index];
+        if (morph.type != Type::UV)
+            continue;
+        for (uint32_t i = morph.dataBegin; i < morph.dataEnd; ++i)
+            uvOffsets_[uvIndices_[i]] = glm::vec2(0);
+    }
+    for (const auto& active : active_) {
+        const auto& morph = morphs_[active.index];
+        if (morph.type != Type::UV)
+            continue;
+        for (uint32_t i = morph.dataBegin; i < morph.dataEnd; ++i)
+            uvOffsets_[uvIndices_[i]] += uvDeltas_[i] * active.weight;
+    }
+
+    // Both the vertices the last morphs were removed from and the ones the
+    // current morphs are added to changed.
+    addUVDirtyRanges(lastActive_);
+    addUVDirtyRanges(active_);
+}
+
+void MorphSet::updateBones() const {
+    // Same as saba::PMXModel::MorphBone().  Applied on top of the initial
+    // transform of the nodes restored by BeginAnimation().
+    for (const auto& active : active_) {
+        const auto& morph = morphs_[active.index];
+        if (morph.type != Type::Bone)
+            continue;
+        for (uint32_t i = morph.dataBegin; i < morph.dataEnd; ++i) {
+            const auto& bone = boneMorphs_[i];
+            auto node = bone.node;
+            node->SetTranslate(node->GetTranslate() + bone.translate * active.weight);
+            node->SetRotate(glm::slerp(node->GetRotate(), bone.rotate, active.weight));
+        }
+    }
+}
+
+void MorphSet::updateMaterials() {
+    const auto isMaterial = [this](const ActiveMorph& active) {
+        return morphs_[active.index].type == Type::Material;
+    };
+    // Materials keep the initial values while no material morph is active.
+    if (std::none_of(active_.begin(), active_.end(), isMaterial) &&
+        std::none_of(lastActive_.begin(), lastActive_.end(), isMaterial))
+        return;
+
+    // Same as saba::PMXModel::BeginMorphMaterial(), MorphMaterial() and
+    // EndMorphMaterial().
+    for (size_t i = 0; i < materials_.size(); ++i) {
+        const auto& init = initMaterials_[i];
+        mulFactors_[i] = {
+            .diffuse = init.m_diffuse,
+            .alpha = init.m_alpha,
+            .specular = init.m_specular,
+            .specularPower = init.m_specularPower,
+            .ambient = init.m_ambient,
+            .edgeColor = init.m_edgeColor,
+            .edgeSize = init.m_edgeSize,
+            .textureFactor = glm::vec4(1),
+            .spTextureFactor = glm::vec4(1),
+            .toonTextureFactor = glm::vec4(1),
+        };
+        addFactors_[i] = {
+            .diffuse = glm::vec3(0),
+            .alpha = 0.0f,
+            .specular = glm::vec3(0),
+            .specularPower = 0.0f,
+            .ambient = glm::vec3(0),
+            .edgeColor = glm::vec4(0),
+            .edgeSize = 0.0f,
+            .textureFactor = glm::vec4(0),
+            .spTextureFactor = glm::vec4(0),
+            .toonTextureFactor = glm::vec4(0),
+        };
+    }
+
+    for (const auto& active : active_) {
+        const auto& morph = morphs_[active.index];
+        if (morph.type != Type::Material)
+            continue;
+        for (uint32_t i = morph.dataBegin; i < morph.dataEnd; ++i) {
+            const auto& materialMorph = materialMorphs_[i];
+            const size_t begin = materialMorph.material < 0 ? 0 : materialMorph.material;
+            const size_t end =
+                materialMorph.material < 0 ? materials_.size() : materialMorph.material + 1;
+            for (size_t m = begin; m < end; ++m) {
+                if (materialMorph.add)
+                    addFactors_[m].Add(materialMorph.factor, active.weight);
+                else
+                    mulFactors_[m].Mul(materialMorph.factor, active.weight);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < materials_.size(); ++i) {
+        const auto& mul = mulFactors_[i];
+        const auto& add = addFactors_[i];
+        MaterialFactor factor = mul;
+        factor.Add(add, 1.0f);
+
+        auto& material = materials_[i];
+        material.m_diffuse = factor.diffuse;
+        material.m_alpha = factor.alpha;
+        material.m_specular = factor.specular;
+        material.m_specularPower = factor.specularPower;
+        material.m_ambient = factor.ambient;
+        material.m_edgeColor = factor.edgeColor;
+        material.m_edgeSize = factor.edgeSize;
+        material.m_textureMulFactor = mul.textureFactor;
+        material.m_spTextureMulFactor = mul.spTextureFactor;
+        material.m_toonTextureMulFactor = mul.toonTextureFactor;
+        material.m_textureAddFactor = add.textureFactor;
+        material.m_spTextureAddFactor = add.spTextureFactor;
+        material.m_toonTextureAddFactor = add.toonTextureFactor;
+    }
+}
+
+void MorphSet::addUVDirtyRanges(const std::vector<ActiveMorph>& active) {
+    for (const auto& entry : active) {
+        const auto& morph = morphs_[entry.index];
+        if (morph.type != Type::UV)
+            continue;
+        uvDirtyRanges_.insert(
+            uvDirtyRanges_.end(), uvRanges_.begin() + morph.rangeBegin,
+            uvRanges_.begin() + morph.rangeEnd);
+    }
+    mergeRanges(uvDirtyRanges_);
+}
@@ -0,0 +1,167 @@
+#ifndef MORPH_HPP_
+#define MORPH_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "Saba/Model/MMD/MMDMaterial.h"
+#include "Saba/Model/MMD/MMDModel.h"
+#include "Saba/Model/MMD/MMDMorph.h"
+#include "Saba/Model/MMD/MMDNode.h"
+#include "Saba/Model/MMD/PMXFile.h"
+#include "glm/glm.hpp"
+#include "glm/gtc/quaternion.hpp"
+#include "util.hpp"
+
+// Morphs of a PMX model applied in place of saba's UpdateMorphAnimation().
+// Only the morphs animated by motions can have non-zero weights, and only a
+// handful of them, mostly facial ones, are non-zero at a time.  So the morphs
+// with non-zero weights are gathered into an active list every frame, and the
+// vertex deltas of each morph are stored sorted by vertex index, so that the
+// work of a frame scales with the deltas of the active morphs.
+class MorphSet : private NonCopyable {
+public:
+    // Vertices in [begin, end).
+    struct Range {
+        uint32_t begin;
+        uint32_t end;
+    };
+
+    // Deltas of an active position morph, sorted by vertex index.
+    struct PositionDeltas {
+        const uint32_t *indices;
+        const glm::vec3 *deltas;
+        uint32_t count;
+        float weight;
+    };
+
+public:
+    MorphSet();
+
+    // "pmx" is the file the model is loaded from, or nullptr for PMD models,
+    // which are left to saba.
+    void Init(saba::MMDModel& model, const saba::PMXFile *pmx);
+
+    // Register morphs animated by a motion.  Weights of the other morphs stay
+    // 0, so they are never looked at.
+    void AddAnimatedMorphs(const std::vector<saba::MMDMorph *>& morphs);
+
+    // Replacement of saba::MMDModel::UpdateMorphAnimation().  Bone morphs are
+    // applied to the nodes, and so this must be called before the nodes are
+    // updated.
+    void Update(saba::MMDModel& model);
+
+    bool IsEnabled() const;
+
+    // Materials after material morphs.
+    const saba::MMDMaterial *GetMaterials() const;
+
+    // Position morphs with non-zero weights, in the order saba applies them.
+    // Applied by Mesh while it skins the vertices.
+    const std::vector<PositionDeltas>& GetActivePositionDeltas() const;
+
+    // UV offsets of all the vertices, and the vertices whose offsets changed
+    // since the last ClearUVDirtyRanges().
+    const glm::vec2 *GetUVOffsets() const;
+    const std::vector<Range>& GetUVDirtyRanges() const;
+    void ClearUVDirtyRanges();
+
+    // Vertices moved by any of the UV morphs, whether animated or not.  May
+    // contain duplicates.
+    const std::vector<uint32_t>& GetUVMorphVertices() const;
+
+private:
+    enum class Type : uint8_t {
+        None,  // Morphs saba doesn't support either, e.g. additional UV.
+        Position,
+        UV,
+        Bone,
+        Material,
+        Group,
+    };
+
+    struct Morph {
+        saba::MMDMorph *morph;
+        Type type;
+        uint32_t dataBegin;  // Range in the data array of the type.
+        uint32_t dataEnd;
+        uint32_t rangeBegin;  // Range in uvRanges_.
+        uint32_t rangeEnd;
+    };
+
+    struct ActiveMorph {
+        uint32_t index;
+        float weight;
+    };
+
+    struct BoneMorph {
+        saba::MMDNode *node;
+        glm::vec3 translate;
+        glm::quat rotate;
+    };
+
+    // Same as MaterialFactor of saba.
+    struct MaterialFactor {
+        glm::vec3 diffuse;
+        float alpha;
+        glm::vec3 specular;
+        float specularPower;
+        glm::vec3 ambient;
+        glm::vec4 edgeColor;
+        float edgeSize;
+        glm::vec4 textureFactor;
+        glm::vec4 spTextureFactor;
+        glm::vec4 toonTextureFactor;
+
+        void Mul(const MaterialFactor& factor, float weight);
+        void Add(const MaterialFactor& factor, float weight);
+    };
+
+    struct MaterialMorph {
+        int32_t material;  // -1 for all the materials.
+        bool add;
+        MaterialFactor factor;
+    };
+
+    struct GroupMember {
+        uint32_t index;
+        float weight;
+    };
+
+    void gatherActiveMorphs();
+    void gatherPositionDeltas();
+    void updateUVs();
+    void updateBones() const;
+    void updateMaterials();
+    void addUVDirtyRanges(const std::vector<ActiveMorph>& active);
+
+    bool enabled_;
+    std::vector<Morph> morphs_;
+    std::vector<uint32_t> animated_;  // Sorted indices in morphs_.
+
+    std::vector<uint32_t> positionIndices_;
+    std::vector<glm::vec3> positionDeltas_;
+    std::vector<uint32_t> uvIndices_;
+    std::vector<glm::vec2> uvDeltas_;
+    std::vector<Range> uvRanges_;
+    std::vector<BoneMorph> boneMorphs_;
+    std::vector<MaterialMorph> materialMorphs_;
+    std::vector<GroupMember> groupMembers_;
+
+    // Group morphs are expanded into their members.  In the order saba
+    // applies morphs in.
+    std::vector<ActiveMorph> active_;
+    std::vector<ActiveMorph> lastActive_;
+
+    std::vector<PositionDeltas> positionDeltaList_;
+    std::vector<glm::vec2> uvOffsets_;
+    std::vector<Range> uvDirtyRanges_;
+
+    std::vector<saba::MMDMaterial> initMaterials_;
+    std::vector<saba::MMDMaterial> materials_;
+    std::vector<MaterialFactor> mulFactors_;
+    std::vector<MaterialFactor> addFactors_;
+    const saba::MMDMaterial *modelMaterials_;
+};
+
+#endif  // MORPH_HPP_
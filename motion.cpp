@@ -0,0 +1,441 @@
+#include "motion.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numbers>
+#include <string>
+#include <unordered_map>
+#include "Saba/Model/MMD/MMDIkSolver.h"
+#include "Saba/Model/MMD/MMDModel.h"
+#include "Saba/Model/MMD/MMDMorph.h"
+#include "Saba/Model/MMD/MMDNode.h"
+#include "Saba/Model/MMD/VMDFile.h"
+#include "glm/glm.hpp"
+#include "glm/gtc/quaternion.hpp"
+
+namespace {
+// Keys stepped over linearly from the cursor before falling back to binary
+// search.
+constexpr size_t maxCursorSteps = 4;
+
+// Keys removed in a row at most by reduction.  Every frame between the kept
+// keys is checked for every candidate, so this bounds the time of reduction.
+constexpr size_t maxReducedKeys = 32;
+
+// Components other than the largest of a unit quaternion are within
+// [-1/sqrt(2), 1/sqrt(2)].
+constexpr float packedQuatScale = 32767.0f * std::numbers::sqrt2_v<float>;
+
+// Returns the index of the first key later than "t", starting from the result
+// of the last call.
+template <typename Key>
+size_t findBoundKey(const std::vector<Key>& keys, float t, size_t cursor) {
+    const auto isBefore = [](float t, const Key& key) { return t < key.time; };
+    cursor = std::min(cursor, keys.size());
+    if (cursor != 0 && keys[cursor - 1].time > t) {
+        // Went back in time.
+        return std::upper_bound(keys.begin(), keys.begin() + cursor, t, isBefore) -
+               keys.begin();
+    }
+    for (size_t i = 0; i < maxCursorSteps; ++i, ++cursor) {
+        if (cursor == keys.size() || keys[cursor].time > t)
+            return cursor;
+    }
+    return std::upper_bound(keys.begin() + cursor, keys.end(), t, isBefore) - keys.begin();
+}
+
+template <typename Track>
+Track& findTrack(
+    std::vector<Track>& tracks,
+    std::unordered_map<const void *, size_t>& indices,
+    decltype(Track::target) target) {
+    const auto [it, inserted] = indices.emplace(target, tracks.size());
+    if (inserted)
+        tracks.push_back({.target = target, .keys = {}, .cursor = 0});
+    return tracks[it->second];
+}
+
+template <typename Track>
+void sortKeys(std::vector<Track>& tracks, int32_t& maxKeyTime) {
+    for (auto& track : tracks) {
+        std::stable_sort(
+            track.keys.begin(), track.keys.end(),
+            [](const auto& x, const auto& y) { return x.time < y.time; });
+        track.cursor = 0;
+        if (!track.keys.empty())
+            maxKeyTime = std::max(maxKeyTime, track.keys.back().time);
+    }
+}
+
+template <typename Track>
+void mapTargets(
+    const std::vector<Track>& tracks,
+    std::unordered_map<const void *, size_t>& indices) {
+    for (size_t i = 0; i < tracks.size(); ++i)
+        indices.emplace(tracks[i].target, i);
+}
+
+float bezierValue(float t, float p1, float p2) {
+    const float it = 1.0f - t;
+    return 3.0f * t * it * it * p1 + 3.0f * t * t * it * p2 + t * t * t;
+}
+
+float angleBetween(const glm::quat& q0, const glm::quat& q1) {
+    return 2.0f * std::acos(std::min(std::abs(glm::dot(q0, q1)), 1.0f));
+}
+}  // namespace
+
+float Motion::Bezier::Eval(float x) const {
+    if (linear)
+        return x;
+
+    // Interpolation parameters are stored in 0-127 in VMD.
+    const glm::vec2 cp1 = glm::vec2(points[0], points[1]) / 127.0f;
+    const glm::vec2 cp2 = glm::vec2(points[2], points[3]) / 127.0f;
+
+    // Find the curve parameter for x by bisection, as saba does.
+    constexpr float e = 1.0e-5f;
+    float start = 0.0f, stop = 1.0f;
+    float t = 0.5f;
+    float currentX = bezierValue(t, cp1.x, cp2.x);
+    while (std::abs(x - currentX) > e) {
+        if (x < currentX)
+            stop = t;
+        else
+            start = t;
+        t = (start + stop) * 0.5f;
+        currentX = bezierValue(t, cp1.x, cp2.x);
+    }
+    return bezierValue(t, cp1.y, cp2.y);
+}
+
+Motion::PackedQuat Motion::PackedQuat::Pack(const glm::quat& q) {
+    std::array<float, 4> c = {q.x, q.y, q.z, q.w};
+    uint8_t largest = 0;
+    for (uint8_t i = 1; i < 4; ++i) {
+        if (std::abs(c[i]) > std::abs(c[largest]))
+            largest = i;
+    }
+    // q and -q are the same rotation, so make the largest one positive.
+    const float sign = c[largest] < 0.0f ? -1.0f : 1.0f;
+    PackedQuat packed = {.components = {0, 0, 0}, .largest = largest};
+    for (int i = 0, j = 0; i < 4; ++i) {
+        if (i != largest) {
+            packed.components[j++] =
+                static_cast<int16_t>(std::lround(c[i] * sign * packedQuatScale));
+        }
+    }
+    return packed;
+}
+
+glm::quat Motion::PackedQuat::Unpack() const {
+    std::array<float, 4> c;
+    float sum = 0.0f;
+    for (int i = 0, j = 0; i < 4; ++i) {
+        if (i != largest) {
+            c[i] = components[j++] / packedQuatScale;
+            sum += c[i] * c[i];
+        }
+    }
+    c[largest] = std::sqrt(std::max(1.0f - sum, 0.0f));
+    return glm::normalize(glm::quat(c[3], c[0], c[1], c[2]));
+}
+
+void MotionTargets::Init(saba::MMDModel& model) {
+    nodes_ = {};
+    morphs_ = {};
+    ikSolvers_ = {};
+
+    // The first ones win for duplicated names, as in saba.
+    auto nodeManager = model.GetNodeManager();
+    for (size_t i = 0; i < nodeManager->GetNodeCount(); ++i) {
+        auto node = nodeManager->GetMMDNode(i);
+        nodes_.modelNames.emplace(node->GetName(), node);
+    }
+    auto morphManager = model.GetMorphManager();
+    for (size_t i = 0; i < morphManager->GetMorphCount(); ++i) {
+        auto morph = morphManager->GetMorph(i);
+        morphs_.modelNames.emplace(morph->GetName(), morph);
+    }
+    auto ikManager = model.GetIKManager();
+    for (size_t i = 0; i < ikManager->GetIKSolverCount(); ++i) {
+        auto solver = ikManager->GetMMDIKSolver(i);
+        ikSolvers_.modelNames.emplace(solver->GetName(), solver);
+    }
+}
+
+saba::MMDNode *MotionTargets::FindNode(const saba::VMDString<15>& name) {
+    return find(nodes_, name);
+}
+
+saba::MMDMorph *MotionTargets::FindMorph(const saba::VMDString<15>& name) {
+    return find(morphs_, name);
+}
+
+saba::MMDIkSolver *MotionTargets::FindIKSolver(const saba::VMDString<20>& name) {
+    return find(ikSolvers_, name);
+}
+
+size_t MotionTargets::NameHash::operator()(std::string_view name) const {
+    return std::hash<std::string_view>()(name);
+}
+
+template <typename Target, size_t Size>
+Target *MotionTargets::find(Table<Target>& table, const saba::VMDString<Size>& name) {
+    const std::string_view raw(name.m_buffer, strnlen(name.m_buffer, Size));
+    if (const auto it = table.vmdNames.find(raw); it != table.vmdNames.end())
+        return it->second;
+
+    const auto it = table.modelNames.find(name.ToUtf8String());
+    Target *target = it == table.modelNames.end() ? nullptr : it->second;
+    table.vmdNames.emplace(raw, target);
+    return target;
+}
+
+Motion::Motion(MotionTargets& targets) : targets_(targets), maxKeyTime_(0) {}
+
+void Motion::Add(const saba::VMDFile& vmd) {
+    std::unordered_map<const void *, size_t> nodeIndices, morphIndices, ikIndices;
+    mapTargets(nodeTracks_, nodeIndices);
+    mapTargets(morphTracks_, morphIndices);
+    mapTargets(ikTracks_, ikIndices);
+
+    for (const auto& motion : vmd.m_motions) {
+        auto node = targets_.FindNode(motion.m_boneName);
+        if (!node)
+            continue;
+
+        // Convert from the left-handed coordinates of MMD.  Mirroring about
+        // the Z axis is the same as (x, y, z) -> (-x, -y, z) for a rotation.
+        const auto& q = motion.m_quaternion;
+        const auto& ip = motion.m_interpolation;
+        const auto makeBezier = [&ip](size_t i) {
+            const Bezier bezier = {
+                .points = {ip[i], ip[i + 4], ip[i + 8], ip[i + 12]},
+                .linear = ip[i] == ip[i + 4] && ip[i + 8] == ip[i + 12],
+            };
+            return bezier;
+        };
+        findTrack(nodeTracks_, nodeIndices, node)
+            .keys.push_back({
+                .time = static_cast<int32_t>(motion.m_frame),
+                .translate = motion.m_translate * glm::vec3(1, 1, -1),
+                .rotate = PackedQuat::Pack(glm::quat(q.w, -q.x, -q.y, q.z)),
+                .translateBeziers = {makeBezier(0), makeBezier(1), makeBezier(2)},
+                .rotateBezier = makeBezier(3),
+            });
+    }
+
+    for (const auto& morph : vmd.m_morphs) {
+        auto target = targets_.FindMorph(morph.m_blendShapeName);
+        if (!target)
+            continue;
+        findTrack(morphTracks_, morphIndices, target)
+            .keys.push_back({
+                .time = static_cast<int32_t>(morph.m_frame),
+                .weight = morph.m_weight,
+            });
+    }
+
+    for (const auto& ik : vmd.m_iks) {
+        for (const auto& info : ik.m_ikInfos) {
+            auto solver = targets_.FindIKSolver(info.m_name);
+            if (!solver)
+                continue;
+            findTrack(ikTracks_, ikIndices, solver)
+                .keys.push_back({
+                    .time = static_cast<int32_t>(ik.m_frame),
+                    .enable = info.m_enable != 0,
+                });
+        }
+    }
+
+    sortKeys(nodeTracks_, maxKeyTime_);
+    sortKeys(morphTracks_, maxKeyTime_);
+    sortKeys(ikTracks_, maxKeyTime_);
+}
+
+int32_t Motion::GetMaxKeyTime() const {
+    return maxKeyTime_;
+}
+
+std::vector<saba::MMDMorph *> Motion::GetAnimatedMorphs() const {
+    std::vector<saba::MMDMorph *> morphs;
+    for (const auto& track : morphTracks_)
+        morphs.push_back(track.target);
+    return morphs;
+}
+
+Motion::ReductionStats Motion::Reduce(const Tolerance& tolerance) {
+    ReductionStats stats = {
+        .keysBefore = 0,
+        .keysAfter = 0,
+        .bytesBefore = 0,
+        .bytesAfter = 0,
+        .maxRotationError = 0.0f,
+        .maxTranslationError = 0.0f,
+    };
+
+    // Extend the span from each kept key as far as the keys in it are
+    // reproduced.  The interpolation of the span then uses the curves of the
+    // key at its end.
+    std::vector<NodeKey> reduced;
+    for (auto& track : nodeTracks_) {
+        auto& keys = track.keys;
+        stats.keysBefore += keys.size();
+        stats.bytesBefore += keys.capacity() * sizeof(NodeKey);
+        if (keys.size() > 2) {
+            reduced.clear();
+            reduced.push_back(keys.front());
+            float maxRotationError = 0.0f, maxTranslationError = 0.0f;
+            size_t begin = 0;
+            while (begin + 1 < keys.size()) {
+                size_t end = begin + 1;
+                float rotationError = 0.0f, translationError = 0.0f;
+                for (size_t candidate = begin + 2;
+                     candidate < keys.size() && candidate - begin <= maxReducedKeys;
+                     ++candidate) {
+                    if (!isReproducible(
+                            keys, begin, candidate, tolerance, rotationError,
+                            translationError))
+                        break;
+                    end = candidate;
+                    maxRotationError = std::max(maxRotationError, rotationError);
+                    maxTranslationError = std::max(maxTranslationError, translationError);
+                }
+                reduced.push_back(keys[end]);
+                begin = end;
+            }
+            keys.assign(reduced.begin(), reduced.end());
+            keys.shrink_to_fit();
+            stats.maxRotationError = std::max(stats.maxRotationError, maxRotationError);
+            stats.maxTranslationError =
+                std::max(stats.maxTranslationError, maxTranslationError);
+        }
+        track.cursor = 0;
+        stats.keysAfter += keys.size();
+        stats.bytesAfter += keys.capacity() * sizeof(NodeKey);
+    }
+    return stats;
+}
+
+void Motion::Evaluate(float t, float weight) {
+    for (auto& track : nodeTracks_)
+        evaluateNode(track, t, weight);
+    for (auto& track : ikTracks_)
+        evaluateIK(track, t, weight);
+    for (auto& track : morphTracks_)
+        evaluateMorph(track, t, weight);
+}
+
+void Motion::interpolate(
+    const NodeKey& key0,
+    const NodeKey& key1,
+    float t,
+    glm::vec3& translate,
+    glm::quat& rotate) {
+    const float x = (t - key0.time) / static_cast<float>(key1.time - key0.time);
+    const glm::vec3 ratio(
+        key1.translateBeziers[0].Eval(x), key1.translateBeziers[1].Eval(x),
+        key1.translateBeziers[2].Eval(x));
+    translate = glm::mix(key0.translate, key1.translate, ratio);
+    rotate = glm::slerp(key0.rotate.Unpack(), key1.rotate.Unpack(), key1.rotateBezier.Eval(x));
+}
+
+// Compare the keys in [begin, end] with the interpolation between the keys at
+// "begin" and "end" at every frame in between.
+bool Motion::isReproducible(
+    const std::vector<NodeKey>& keys,
+    size_t begin,
+    size_t end,
+    const Tolerance& tolerance,
+    float& rotationError,
+    float& translationError) {
+    rotationError = translationError = 0.0f;
+    size_t segment = begin;
+    for (int32_t frame = keys[begin].time + 1; frame < keys[end].time; ++frame) {
+        while (keys[segment + 1].time <= frame)
+            ++segment;
+        glm::vec3 translate, reducedTranslate;
+        glm::quat rotate, reducedRotate;
+        const float t = static_cast<float>(frame);
+        interpolate(keys[segment], keys[segment + 1], t, translate, rotate);
+        interpolate(keys[begin], keys[end], t, reducedTranslate, reducedRotate);
+        rotationError = std::max(rotationError, angleBetween(rotate, reducedRotate));
+        translationError =
+            std::max(translationError, glm::distance(translate, reducedTranslate));
+        if (rotationError > tolerance.rotation || translationError > tolerance.translation)
+            return false;
+    }
+    return true;
+}
+
+void Motion::evaluateNode(Track<saba::MMDNode, NodeKey>& track, float t, float weight) {
+    const auto& keys = track.keys;
+    if (keys.empty())
+        return;
+
+    track.cursor = findBoundKey(keys, t, track.cursor);
+    glm::vec3 translate;
+    glm::quat rotate;
+    if (track.cursor == keys.size()) {
+        translate = keys.back().translate;
+        rotate = keys.back().rotate.Unpack();
+    } else if (track.cursor == 0) {
+        translate = keys.front().translate;
+        rotate = keys.front().rotate.Unpack();
+    } else {
+        interpolate(keys[track.cursor - 1], keys[track.cursor], t, translate, rotate);
+    }
+
+    auto node = track.target;
+    if (weight == 1.0f) {
+        node->SetAnimationRotate(rotate);
+        node->SetAnimationTranslate(translate);
+    } else {
+        const glm::vec3& baseTranslate = node->GetBaseAnimationTranslate();
+        node->SetAnimationRotate(glm::slerp(node->GetBaseAnimationRotate(), rotate, weight));
+        node->SetAnimationTranslate(glm::mix(baseTranslate, translate, weight));
+    }
+}
+
+void Motion::evaluateMorph(Track<saba::MMDMorph, MorphKey>& track, float t, float weight) {
+    const auto& keys = track.keys;
+    if (keys.empty())
+        return;
+
+    track.cursor = findBoundKey(keys, t, track.cursor);
+    float value;
+    if (track.cursor == keys.size()) {
+        value = keys.back().weight;
+    } else if (track.cursor == 0) {
+        value = keys.front().weight;
+    } else {
+        const auto& key0 = keys[track.cursor - 1];
+        const auto& key1 = keys[track.cursor];
+        const float x = (t - key0.time) / static_cast<float>(key1.time - key0.time);
+        value = glm::mix(key0.weight, key1.weight, x);
+    }
+
+    auto morph = track.target;
+    if (weight == 1.0f)
+        morph->SetWeight(value);
+    else
+        morph->SetWeight(glm::mix(morph->GetBaseAnimationWeight(), value, weight));
+}
+
+void Motion::evaluateIK(Track<saba::MMDIkSolver, IKKey>& track, float t, float weight) {
+    const auto& keys = track.keys;
+    if (keys.empty())
+        return;
+
+    // IK is switched on and off at keys without interpolation.
+    track.cursor = findBoundKey(keys, t, track.cursor);
+    const bool enable = keys[track.cursor == 0 ? 0 : track.cursor - 1].enable;
+
+    auto solver = track.target;
+    if (weight < 0.5f)
+        solver->Enable(solver->GetBaseAnimationEnabled());
+    else
+        solver->Enable(enable);
+}
@@ -0,0 +1,166 @@
+#ifndef MOTION_HPP_
+#define MOTION_HPP_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "Saba/Model/MMD/MMDIkSolver.h"
+#include "Saba/Model/MMD/MMDModel.h"
+#include "Saba/Model/MMD/MMDMorph.h"
+#include "Saba/Model/MMD/MMDNode.h"
+#include "Saba/Model/MMD/VMDFile.h"
+#include "glm/glm.hpp"
+#include "glm/gtc/quaternion.hpp"
+#include "util.hpp"
+
+// Bones, morphs and IK solvers of a model looked up by the names in VMD files,
+// shared by all the motions of the model.  VMD names are Shift-JIS, and saba
+// converts them to UTF-8 and searches the model linearly for every key.  Here
+// each distinct VMD name is resolved once, including names the model doesn't
+// have, and later keys with the name take a hash lookup of the raw bytes.
+class MotionTargets : private NonCopyable {
+public:
+    void Init(saba::MMDModel& model);
+
+    // nullptr for names the model doesn't have.
+    saba::MMDNode *FindNode(const saba::VMDString<15>& name);
+    saba::MMDMorph *FindMorph(const saba::VMDString<15>& name);
+    saba::MMDIkSolver *FindIKSolver(const saba::VMDString<20>& name);
+
+private:
+    struct NameHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view name) const;
+    };
+
+    template <typename Target>
+    using NameMap = std::unordered_map<std::string, Target *, NameHash, std::equal_to<>>;
+
+    template <typename Target>
+    struct Table {
+        NameMap<Target> modelNames;  // By the UTF-8 names in the model.
+        NameMap<Target> vmdNames;    // By the raw names in VMD files.
+    };
+
+    template <typename Target, size_t Size>
+    static Target *find(Table<Target>& table, const saba::VMDString<Size>& name);
+
+    Table<saba::MMDNode> nodes_;
+    Table<saba::MMDMorph> morphs_;
+    Table<saba::MMDIkSolver> ikSolvers_;
+};
+
+// Keyframe animation of bones, morphs and IK made from VMD files, in place of
+// saba::VMDAnimation.  The results are the same as saba's except for the
+// precision of rotations, which are stored quantized.  Each track keeps a
+// cursor at the key it was evaluated at last time.  Playback moves forward by
+// less than a key per frame in most cases, so the next key is found by
+// stepping from the cursor, and binary search is done only when the time
+// jumps, i.e. on seeks and motion switches.
+class Motion : private NonCopyable {
+public:
+    struct Tolerance {
+        float rotation;  // In radians.
+        float translation;
+    };
+
+    struct ReductionStats {
+        size_t keysBefore;
+        size_t keysAfter;
+        size_t bytesBefore;
+        size_t bytesAfter;
+        float maxRotationError;  // In radians.
+        float maxTranslationError;
+    };
+
+public:
+    explicit Motion(MotionTargets& targets);
+
+    // Add the keys of bones, morphs and IK in a VMD file.  Keys of bones and
+    // morphs the model doesn't have are dropped.
+    void Add(const saba::VMDFile& vmd);
+    int32_t GetMaxKeyTime() const;
+    std::vector<saba::MMDMorph *> GetAnimatedMorphs() const;
+
+    // Remove the bone keys that interpolation between the remaining keys
+    // reproduces within "tolerance" at every frame.  Captured motions have a
+    // key at every frame, most of which can be removed.  Call after all the
+    // VMD files are added.
+    ReductionStats Reduce(const Tolerance& tolerance);
+
+    // Set the animation at frame "t" to the model.  With weight less than 1,
+    // the result is blended with the base animation saved in the model.
+    void Evaluate(float t, float weight = 1.0f);
+
+private:
+    struct Bezier {
+        std::array<uint8_t, 4> points;  // x1, y1, x2 and y2 in 0-127 as in VMD.
+        bool linear;  // Control points on the diagonal; the curve is y = x.
+        float Eval(float x) const;
+    };
+
+    // A unit quaternion in 8 bytes.  The three smallest components are stored
+    // in 16 bits each, and the largest one is restored from them.
+    struct PackedQuat {
+        std::array<int16_t, 3> components;
+        uint8_t largest;  // Index of the largest component in x, y, z, w.
+        static PackedQuat Pack(const glm::quat& q);
+        glm::quat Unpack() const;
+    };
+
+    struct NodeKey {
+        int32_t time;
+        glm::vec3 translate;
+        PackedQuat rotate;
+        std::array<Bezier, 3> translateBeziers;
+        Bezier rotateBezier;
+    };
+
+    struct MorphKey {
+        int32_t time;
+        float weight;
+    };
+
+    struct IKKey {
+        int32_t time;
+        bool enable;
+    };
+
+    template <typename Target, typename Key>
+    struct Track {
+        Target *target;
+        std::vector<Key> keys;
+        size_t cursor;  // Index of the first key later than the last time.
+    };
+
+    static void interpolate(
+        const NodeKey& key0,
+        const NodeKey& key1,
+        float t,
+        glm::vec3& translate,
+        glm::quat& rotate);
+    static bool isReproducible(
+        const std::vector<NodeKey>& keys,
+        size_t begin,
+        size_t end,
+        const Tolerance& tolerance,
+        float& rotationError,
+        float& translationError);
+
+    void evaluateNode(Track<saba::MMDNode, NodeKey>& track, float t, float weight);
+    void evaluateMorph(Track<saba::MMDMorph, MorphKey>& track, float t, float weight);
+    void evaluateIK(Track<saba::MMDIkSolver, IKKey>& track, float t, float weight);
+
+    MotionTargets& targets_;
+    std::vector<Track<saba::MMDNode, NodeKey>> nodeTracks_;
+    std::vector<Track<saba::MMDMorph, MorphKey>> morphTracks_;
+    std::vector<Track<saba::MMDIkSolver, IKKey>> ikTracks_;
+    int32_t maxKeyTime_;
+};
+
+#endif  // MOTION_HPP_
@@ -0,0 +1,319 @@
+#include "physics.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <string_view>
+#include "Saba/Model/MMD/MMDModel.h"
+#include "Saba/Model/MMD/MMDNode.h"
+#include "Saba/Model/MMD/MMDPhysics.h"
+#include "btBulletDynamicsCommon.h"  // IWYU pragma: keep; supress warning from clangd.
+#include "constant.hpp"
+
+namespace {
+constexpr std::string_view snapshotMagic = "yoMMDphy";
+constexpr uint32_t snapshotVersion = 1;
+
+// 4x4 transform matrix, linear velocity and angular velocity.
+constexpr size_t floatsPerBody = 16 + 3 + 3;
+
+struct LODLevel {
+    float minPixelHeight;  // This level is used while the model is higher than this on screen.
+    float iterationScale;
+    float fpsScale;
+};
+constexpr std::array<LODLevel, 3> lodLevels = {{
+    {.minPixelHeight = 400.0f, .iterationScale = 1.0f, .fpsScale = 1.0f},
+    {.minPixelHeight = 150.0f, .iterationScale = 0.5f, .fpsScale = 0.5f},
+    {.minPixelHeight = 0.0f, .iterationScale = 0.25f, .fpsScale = 0.5f},
+}};
+
+// Rigid bodies smaller than this in pixels are frozen.
+constexpr float freezePixelSize = 3.0f;
+
+// Ratio a threshold must be exceeded by to go back to the finer detail.
+constexpr float lodHysteresis = 1.25f;
+
+void setBodyState(
+    btRigidBody *body,
+    const btTransform& transform,
+    const btVector3& linearVelocity,
+    const btVector3& angularVelocity) {
+    body->setWorldTransform(transform);
+    body->setInterpolationWorldTransform(transform);
+    body->setLinearVelocity(linearVelocity);
+    body->setAngularVelocity(angularVelocity);
+    body->setInterpolationLinearVelocity(linearVelocity);
+    body->setInterpolationAngularVelocity(angularVelocity);
+    body->clearForces();
+    body->getMotionState()->setWorldTransform(transform);
+    body->activate(true);
+}
+
+// Make a frozen rigid body dynamic again, starting from where it is now.  The
+// dynamic motion state still holds the transform of when it was frozen.
+void thaw(saba::MMDRigidBody& rb) {
+    btRigidBody *body = rb.GetRigidBody();
+    const btTransform transform = body->getWorldTransform();
+    rb.SetActivation(true);
+    setBodyState(body, transform, btVector3(0, 0, 0), btVector3(0, 0, 0));
+}
+
+void updateRootNodes(saba::MMDModel& model) {
+    auto nodeManager = model.GetNodeManager();
+    const size_t nodeCount = nodeManager->GetNodeCount();
+    for (size_t i = 0; i < nodeCount; ++i) {
+        auto node = nodeManager->GetMMDNode(i);
+        if (node->GetParent() == nullptr)
+            node->UpdateGlobalTransform();
+    }
+}
+}  // namespace
+
+bool PhysicsSnapshot::IsEmpty() const {
+    return bodies_.empty();
+}
+
+void PhysicsSnapshot::Capture(saba::MMDModel& model) {
+    const auto& rigidBodies = *model.GetPhysicsManager()->GetRigidBodys();
+    bodies_.clear();
+    bodies_.reserve(rigidBodies.size());
+    for (const auto& rb : rigidBodies) {
+        const btRigidBody *body = rb->GetRigidBody();
+        bodies_.push_back({
+            .transform = body->getWorldTransform(),
+            .linearVelocity = body->getLinearVelocity(),
+            .angularVelocity = body->getAngularVelocity(),
+        });
+    }
+}
+
+void PhysicsSnapshot::Restore(saba::MMDModel& model) const {
+    const auto& rigidBodies = *model.GetPhysicsManager()->GetRigidBodys();
+    if (rigidBodies.size() != bodies_.size())
+        return;
+
+    for (size_t i = 0; i < rigidBodies.size(); ++i) {
+        auto& rb = rigidBodies[i];
+        btRigidBody *body = rb->GetRigidBody();
+
+        // Kinematic bodies follow their bones.  Only bodies driven by physics
+        // have a state worth restoring.
+        if (body->getInvMass() == 0.0f)
+            continue;
+
+        // Make sure the dynamic motion state is in use so that the restored
+        // transform is reflected to the node.
+        rb->SetActivation(true);
+
+        const auto& state = bodies_[i];
+        setBodyState(body, state.transform, state.linearVelocity, state.angularVelocity);
+    }
+
+    // Same as the tail of saba::MMDModel::UpdatePhysicsAnimation().
+    for (auto& rb : rigidBodies)
+        rb->ReflectGlobalTransform();
+    for (auto& rb : rigidBodies)
+        rb->CalcLocalTransform();
+    updateRootNodes(model);
+}
+
+bool PhysicsSnapshot::Save(const std::filesystem::path& path) const {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file)
+        return false;
+
+    const uint32_t bodyCount = bodies_.size();
+    file.write(snapshotMagic.data(), snapshotMagic.size());
+    file.write(reinterpret_cast<const char *>(&snapshotVersion), sizeof(snapshotVersion));
+    file.write(reinterpret_cast<const char *>(&bodyCount), sizeof(bodyCount));
+    for (const auto& state : bodies_) {
+        std::array<float, floatsPerBody> values;
+        state.transform.getOpenGLMatrix(values.data());
+        for (int i = 0; i < 3; ++i) {
+            values[16 + i] = state.linearVelocity[i];
+            values[19 + i] = state.angularVelocity[i];
+        }
+        file.write(reinterpret_cast<const char *>(values.data()), sizeof(values));
+    }
+    return static_cast<bool>(file);
+}
+
+bool PhysicsSnapshot::Load(const std::filesystem::path& path, size_t bodyCount) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        return false;
+
+    std::array<char, snapshotMagic.size()> magic;
+    uint32_t version = 0, count = 0;
+    file.read(magic.data(), magic.size());
+    file.read(reinterpret_cast<char *>(&version), sizeof(version));
+    file.read(reinterpret_cast<char *>(&count), sizeof(count));
+    if (!file || std::string_view(magic.data(), magic.size()) != snapshotMagic ||
+        version != snapshotVersion || count != bodyCount)
+        return false;
+
+    std::vector<BodyState> bodies;
+    bodies.reserve(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        std::array<float, floatsPerBody> values;
+        file.read(reinterpret_cast<char *>(values.data()), sizeof(values));
+        if (!file)
+            return false;
+
+        BodyState state;
+        state.transform.setFromOpenGLMatrix(values.data());
+        state.linearVelocity = btVector3(values[16], values[17], values[18]);
+        state.angularVelocity = btVector3(values[19], values[20], values[21]);
+        bodies.push_back(state);
+    }
+    bodies_ = std::move(bodies);
+    return true;
+}
+
+PhysicsLOD::PhysicsLOD() :
+    level_(0),
+    simulationFPS_(0.0f),
+    solverIterations_(0),
+    aabbMin_(0.0f, 0.0f, 0.0f),
+    aabbMax_(0.0f, 0.0f, 0.0f) {}
+
+void PhysicsLOD::Init(saba::MMDModel& model, float simulationFPS) {
+    level_ = 0;
+    simulationFPS_ = simulationFPS;
+    solverIterations_ =
+        model.GetMMDPhysics()->GetDynamicsWorld()->getSolverInfo().m_numIterations;
+
+    const size_t vertCount = model.GetVertexCount();
+    const glm::vec3 *positions = model.GetPositions();
+    if (vertCount != 0)
+        aabbMin_ = aabbMax_ = positions[0];
+    for (size_t i = 0; i < vertCount; ++i) {
+        aabbMin_ = glm::min(aabbMin_, positions[i]);
+        aabbMax_ = glm::max(aabbMax_, positions[i]);
+    }
+
+    const auto& rigidBodies = *model.GetPhysicsManager()->GetRigidBodys();
+    bodySizes_.clear();
+    bodySizes_.reserve(rigidBodies.size());
+    for (const auto& rb : rigidBodies) {
+        const btRigidBody *body = rb->GetRigidBody();
+        if (body->getInvMass() == 0.0f) {
+            bodySizes_.push_back(0.0f);
+            continue;
+        }
+        btVector3 min, max;
+        body->getCollisionShape()->getAabb(btTransform::getIdentity(), min, max);
+        bodySizes_.push_back((max - min).length());
+    }
+    frozen_.assign(rigidBodies.size(), false);
+}
+
+void PhysicsLOD::Update(
+    saba::MMDModel& model,
+    const glm::mat4& wvp,
+    const glm::vec2& drawableSize,
+    const glm::vec3& boundsMin,
+    const glm::vec3& boundsMax) {
+    const float pixelHeight = getPixelHeight(wvp, drawableSize, boundsMin, boundsMax);
+
+    size_t level = level_;
+    while (level + 1 < lodLevels.size() && pixelHeight < lodLevels[level].minPixelHeight)
+        ++level;
+    while (level > 0 && pixelHeight > lodLevels[level - 1].minPixelHeight * lodHysteresis)
+        --level;
+    if (level != level_) {
+        level_ = level;
+        applyLevel(model);
+    }
+
+    // Freezing a body of a chain makes it move rigidly with its bone, which
+    // merges it into the segment above through the joint.
+    const float modelHeight = aabbMax_.y - aabbMin_.y;
+    if (modelHeight <= 0.0f)
+        return;
+    const float pixelsPerUnit = pixelHeight / modelHeight;
+    const auto& rigidBodies = *model.GetPhysicsManager()->GetRigidBodys();
+    for (size_t i = 0; i < rigidBodies.size(); ++i) {
+        if (bodySizes_[i] == 0.0f)
+            continue;
+        const float size = bodySizes_[i] * pixelsPerUnit;
+        if (!frozen_[i] && size < freezePixelSize) {
+            frozen_[i] = true;
+        } else if (frozen_[i] && size > freezePixelSize * lodHysteresis) {
+            frozen_[i] = false;
+            thaw(*rigidBodies[i]);
+        }
+    }
+}
+
+void PhysicsLOD::Reset(saba::MMDModel& model) {
+    level_ = 0;
+    applyLevel(model);
+    const auto& rigidBodies = *model.GetPhysicsManager()->GetRigidBodys();
+    for (size_t i = 0; i < rigidBodies.size(); ++i) {
+        if (frozen_[i]) {
+            frozen_[i] = false;
+            thaw(*rigidBodies[i]);
+        }
+    }
+}
+
+void PhysicsLOD::UpdatePhysicsAnimation(saba::MMDModel& model, float elapsed) const {
+    auto physics = model.GetMMDPhysics();
+    if (physics == nullptr)
+        return;
+
+    const auto& rigidBodies = *model.GetPhysicsManager()->GetRigidBodys();
+    for (size_t i = 0; i < rigidBodies.size(); ++i)
+        rigidBodies[i]->SetActivation(!frozen_[i]);
+
+    physics->Update(elapsed);
+
+    // saba reflects the dynamic motion state even while a body is kinematic,
+    // which for a frozen body still holds the transform of when it was frozen.
+    // The nodes of frozen bodies keep their animated local transforms instead,
+    // so that they follow their parents.
+    for (size_t i = 0; i < rigidBodies.size(); ++i) {
+        if (!frozen_[i])
+            rigidBodies[i]->ReflectGlobalTransform();
+    }
+    for (size_t i = 0; i < rigidBodies.size(); ++i) {
+        if (!frozen_[i])
+            rigidBodies[i]->CalcLocalTransform();
+    }
+    updateRootNodes(model);
+}
+
+void PhysicsLOD::applyLevel(saba::MMDModel& model) const {
+    const auto& level = lodLevels[level_];
+    auto physics = model.GetMMDPhysics();
+    auto& solverInfo = physics->GetDynamicsWorld()->getSolverInfo();
+    solverInfo.m_numIterations =
+        std::max(1, static_cast<int>(solverIterations_ * level.iterationScale));
+    physics->SetFPS(std::max(Constant::VmdFPS, simulationFPS_ * level.fpsScale));
+}
+
+float PhysicsLOD::getPixelHeight(
+    const glm::mat4& wvp,
+    const glm::vec2& drawableSize,
+    const glm::vec3& boundsMin,
+    const glm::vec3& boundsMax) {
+    float minY = std::numeric_limits<float>::max();
+    float maxY = std::numeric_limits<float>::lowest();
+    for (int i = 0; i < 8; ++i) {
+        const glm::vec3 corner(
+            (i & 1) ? boundsMax.x : boundsMin.x, (i & 2) ? boundsMax.y : boundsMin.y,
+            (i & 4) ? boundsMax.z : boundsMin.z);
+        const glm::vec4 clip = wvp * glm::vec4(corner, 1.0f);
+        if (clip.w <= 0.0f) {
+            // The camera is inside the model.
+            return std::numeric_limits<float>::max();
+        }
+        minY = std::min(minY, clip.y / clip.w);
+        maxY = std::max(maxY, clip.y / clip.w);
+    }
+    return (maxY - minY) * drawableSize.y / 2.0f;
+}
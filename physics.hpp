@@ -0,0 +1,83 @@
+#ifndef PHYSICS_HPP_
+#define PHYSICS_HPP_
+
+#include <filesystem>
+#include <vector>
+#include "Saba/Model/MMD/MMDModel.h"
+#include "glm/glm.hpp"
+#include "btBulletDynamicsCommon.h"  // IWYU pragma: keep; supress warning from clangd.
+
+// Rigid body state of a model captured after physics has settled.  Restoring
+// this lets the simulation start from a relaxed state instead of settling from
+// a discontinuous pose, which costs many substeps and makes hair and skirts
+// explode.
+class PhysicsSnapshot {
+public:
+    bool IsEmpty() const;
+    void Capture(saba::MMDModel& model);
+
+    // Restore the captured state.  Node animation before physics must already
+    // be evaluated because the global transforms of the physics-driven nodes
+    // are recalculated from the restored rigid bodies.
+    void Restore(saba::MMDModel& model) const;
+
+    bool Save(const std::filesystem::path& path) const;
+    bool Load(const std::filesystem::path& path, size_t bodyCount);
+
+private:
+    struct BodyState {
+        btTransform transform;
+        btVector3 linearVelocity;
+        btVector3 angularVelocity;
+    };
+
+    std::vector<BodyState> bodies_;
+};
+
+// Level of detail of physics simulation driven by the size of the model on
+// screen.  Solver iterations and the simulation rate are lowered as the model
+// gets smaller, and dynamic rigid bodies too small to be seen are frozen to
+// follow their bones as kinematic bodies.  Thresholds have hysteresis so that
+// the simulation doesn't switch back and forth around them.
+class PhysicsLOD {
+public:
+    PhysicsLOD();
+    void Init(saba::MMDModel& model, float simulationFPS);
+
+    // Select level of detail.  "wvp" is the matrix which transforms the model
+    // world into clip space, and "boundsMin" and "boundsMax" are the bounding
+    // box of the deformed vertices.
+    void Update(
+        saba::MMDModel& model,
+        const glm::mat4& wvp,
+        const glm::vec2& drawableSize,
+        const glm::vec3& boundsMin,
+        const glm::vec3& boundsMax);
+
+    // Go back to the finest level and thaw all the rigid bodies, e.g. to settle
+    // physics in the same way whenever it's done.  Update() selects the level
+    // again from there.
+    void Reset(saba::MMDModel& model);
+
+    // Replacement of saba::MMDModel::UpdatePhysicsAnimation(), which activates
+    // all the rigid bodies including frozen ones.
+    void UpdatePhysicsAnimation(saba::MMDModel& model, float elapsed) const;
+
+private:
+    void applyLevel(saba::MMDModel& model) const;
+    static float getPixelHeight(
+        const glm::mat4& wvp,
+        const glm::vec2& drawableSize,
+        const glm::vec3& boundsMin,
+        const glm::vec3& boundsMax);
+
+    size_t level_;
+    float simulationFPS_;
+    int solverIterations_;
+    glm::vec3 aabbMin_;  // Bounding box of the model in bind pose.
+    glm::vec3 aabbMax_;
+    std::vector<float> bodySizes_;  // 0 for bodies not driven by physics.
+    std::vector<bool> frozen_;
+};
+
+#endif  // PHYSICS_HPP_
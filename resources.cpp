@@ -1,30 +1,61 @@
 // Handles embedded data.
 #include "resources.hpp"
-#include "util.hpp"
+#include "auto/toons.hpp"
 
 #define INCBIN_PREFIX _
 #include "incbin.h"
 
-#include <filesystem>
+#include <array>
+#include <cstdint>
+#include <iterator>
 #include <string_view>
 
 extern "C" {
-INCBIN(Toon01, "toons/toon01.bmp");
-INCBIN(Toon02, "toons/toon02.bmp");
-INCBIN(Toon03, "toons/toon03.bmp");
-INCBIN(Toon04, "toons/toon04.bmp");
-INCBIN(Toon05, "toons/toon05.bmp");
-INCBIN(Toon06, "toons/toon06.bmp");
-INCBIN(Toon07, "toons/toon07.bmp");
-INCBIN(Toon08, "toons/toon08.bmp");
-INCBIN(Toon09, "toons/toon09.bmp");
-INCBIN(Toon10, "toons/toon10.bmp");
 INCBIN(StatusIcon, "icons/statusicon.png");
 }
 
-namespace Resource {
-namespace fs = std::filesystem;
+namespace {
+using Resource::EmbeddedToon::toons;
+
+// Toons are looked up by a perfect hash of their names built at compile time.
+constexpr size_t toonTableSize = 16;
+static_assert(std::size(toons) <= toonTableSize);
+
+constexpr uint32_t hashName(std::string_view name, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (const char c : name) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 16777619u;
+    }
+    return hash;
+}
 
+// The first seed with which the names of the toons fall into distinct slots.
+constexpr uint32_t toonSeed = [] {
+    for (uint32_t seed = 0;; ++seed) {
+        std::array<bool, toonTableSize> used{};
+        bool collided = false;
+        for (const auto& toon : toons) {
+            auto& slot = used[hashName(toon.name, seed) % toonTableSize];
+            collided = collided || slot;
+            slot = true;
+        }
+        if (!collided)
+            return seed;
+    }
+}();
+
+// Indices of toons in slots, or -1 for empty slots.
+constexpr std::array<int, toonTableSize> toonTable = [] {
+    std::array<int, toonTableSize> table;
+    table.fill(-1);
+    for (size_t i = 0; i < std::size(toons); ++i)
+        table[hashName(toons[i].name, toonSeed) % toonTableSize] = i;
+    return table;
+}();
+}  // namespace
+
+namespace Resource {
 const unsigned char *View::data() const {
     return first;
 }
@@ -33,32 +64,13 @@ std::size_t View::length() const {
     return second;
 }
 
-View getToonData(std::string_view path) {
-    const std::string basename = fs::path(String::tou8(path)).filename().string();
-    if (basename == "toon01.bmp") {
-        return {_Toon01Data, _Toon01Size};
-    } else if (basename == "toon02.bmp") {
-        return {_Toon02Data, _Toon02Size};
-    } else if (basename == "toon03.bmp") {
-        return {_Toon03Data, _Toon03Size};
-    } else if (basename == "toon04.bmp") {
-        return {_Toon04Data, _Toon04Size};
-    } else if (basename == "toon05.bmp") {
-        return {_Toon05Data, _Toon05Size};
-    } else if (basename == "toon06.bmp") {
-        return {_Toon06Data, _Toon06Size};
-    } else if (basename == "toon07.bmp") {
-        return {_Toon07Data, _Toon07Size};
-    } else if (basename == "toon08.bmp") {
-        return {_Toon08Data, _Toon08Size};
-    } else if (basename == "toon09.bmp") {
-        return {_Toon09Data, _Toon09Size};
-    } else if (basename == "toon10.bmp") {
-        return {_Toon10Data, _Toon10Size};
-    } else {
-        Err::Log("Internal error: Unknown toon image:", path);
-        return {nullptr, 0};
-    }
+const Toon *findToon(std::string_view path) {
+    const size_t pos = path.find_last_of("/\\");
+    const auto name = pos == std::string_view::npos ? path : path.substr(pos + 1);
+    const int index = toonTable[hashName(name, toonSeed) % toonTableSize];
+    if (index < 0 || toons[index].name != name)
+        return nullptr;
+    return &toons[index];
 }
 
 View getStatusIconData() {
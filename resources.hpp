@@ -13,7 +13,19 @@ public:
 
 private:
 };
-View getToonData(std::string_view path);
+
+// Embedded toon texture decoded into RGBA8 at build time.  Rows are stored
+// from the bottom, as Image loads images flipped vertically.
+struct Toon {
+    std::string_view name;
+    int width;
+    int height;
+    View pixels;
+};
+
+// Find the embedded toon by the file name of "path".  Returns nullptr when
+// there's no such toon.
+const Toon *findToon(std::string_view path);
 View getStatusIconData();
 }  // namespace Resource
 
@@ -0,0 +1,636 @@
+#include "skeleton.hpp"
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <ranges>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "Saba/Model/MMD/MMDIkSolver.h"
+#include "Saba/Model/MMD/MMDModel.h"
+#include "Saba/Model/MMD/MMDNode.h"
+#include "Saba/Model/MMD/PMXFile.h"
+#include "Saba/Model/MMD/PMXNode.h"
+#include "glm/glm.hpp"
+#include "glm/gtc/constants.hpp"
+#include "glm/gtc/quaternion.hpp"
+
+namespace {
+// IK stops iterating once the end effector gets this close to the goal.
+constexpr float ikErrorThreshold = 1.0e-4f;
+
+float normalizeAngle(float angle) {
+    while (angle >= glm::two_pi<float>())
+        angle -= glm::two_pi<float>();
+    while (angle < 0.0f)
+        angle += glm::two_pi<float>();
+    return angle;
+}
+
+float diffAngle(float a, float b) {
+    const float diff = normalizeAngle(a) - normalizeAngle(b);
+    if (diff > glm::pi<float>())
+        return diff - glm::two_pi<float>();
+    else if (diff < -glm::pi<float>())
+        return diff + glm::two_pi<float>();
+    return diff;
+}
+
+// Decompose rotation into XYZ euler angles closest to "before".  Same as the
+// one in saba's MMDIkSolver.
+glm::vec3 decompose(const glm::mat3& m, const glm::vec3& before) {
+    constexpr float e = 1.0e-6f;
+    constexpr float pi = glm::pi<float>();
+
+    glm::vec3 r;
+    const float sy = -m[0][2];
+    if (1.0f - std::abs(sy) < e) {
+        r.y = std::asin(sy);
+        const float sx = std::sin(before.x);
+        const float sz = std::sin(before.z);
+        if (std::abs(sx) < std::abs(sz)) {
+            if (std::cos(before.x) > 0.0f) {
+                r.x = 0.0f;
+                r.z = std::asin(-m[1][0]);
+            } else {
+                r.x = pi;
+                r.z = std::asin(m[1][0]);
+            }
+        } else {
+            if (std::cos(before.z) > 0.0f) {
+                r.z = 0.0f;
+                r.x = std::asin(-m[2][1]);
+            } else {
+                r.z = pi;
+                r.x = std::asin(m[2][1]);
+            }
+        }
+    } else {
+        r.x = std::atan2(m[1][2], m[2][2]);
+        r.y = std::asin(-m[0][2]);
+        r.z = std::atan2(m[0][1], m[0][0]);
+    }
+
+    const glm::vec3 candidates[] = {
+        {r.x + pi, pi - r.y, r.z + pi},   {r.x + pi, pi - r.y, r.z - pi},
+        {r.x + pi, -pi - r.y, r.z + pi},  {r.x + pi, -pi - r.y, r.z - pi},
+        {r.x - pi, pi - r.y, r.z + pi},   {r.x - pi, pi - r.y, r.z - pi},
+        {r.x - pi, -pi - r.y, r.z + pi},  {r.x - pi, -pi - r.y, r.z - pi},
+    };
+    const auto error = [&before](const glm::vec3& v) {
+        return std::abs(diffAngle(v.x, before.x)) + std::abs(diffAngle(v.y, before.y)) +
+               std::abs(diffAngle(v.z, before.z));
+    };
+    float minError = error(r);
+    for (const auto& c : candidates) {
+        const float err = error(c);
+        if (err < minError) {
+            minError = err;
+            r = c;
+        }
+    }
+    return r;
+}
+
+inline glm::vec3 getPosition(const saba::MMDNode *node) {
+    return glm::vec3(node->GetGlobalTransform()[3]);
+}
+}  // namespace
+
+Skeleton::Skeleton() : flattened_(false) {}
+
+void Skeleton::Init(saba::MMDModel& model, const saba::PMXFile *pmx) {
+    nodes_.clear();
+    parents_.clear();
+    afterPhysics_.clear();
+    levelEnds_.clear();
+    appendIKSteps_.clear();
+    afterPhysicsSteps_.clear();
+    ikChains_.clear();
+    ikLinks_.clear();
+    ikPaths_.clear();
+    subtrees_.clear();
+
+    auto nodeManager = model.GetNodeManager();
+    const size_t nodeCount = nodeManager->GetNodeCount();
+    std::vector<saba::PMXNode *> pmxNodes;
+    std::unordered_map<const saba::MMDNode *, size_t> indices;
+    for (size_t i = 0; i < nodeCount; ++i) {
+        auto node = dynamic_cast<saba::PMXNode *>(nodeManager->GetMMDNode(i));
+        if (!node)
+            break;
+        pmxNodes.push_back(node);
+        indices.emplace(node, i);
+    }
+
+    // Only PMX is flattened.  PMD has few bones and no append transform.
+    flattened_ = pmx && nodeCount != 0 && pmxNodes.size() == nodeCount &&
+                 pmx->m_bones.size() == nodeCount;
+    if (!flattened_)
+        return;
+
+    // Depth of each bone in the hierarchy.
+    std::vector<size_t> levels(nodeCount, 0);
+    for (size_t i = 0; i < nodeCount; ++i) {
+        for (auto p = pmxNodes[i]->GetParent(); p; p = p->GetParent())
+            ++levels[i];
+    }
+
+    std::vector<size_t> order(nodeCount);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&levels](size_t x, size_t y) {
+        return levels[x] < levels[y];
+    });
+
+    std::vector<int32_t> positions(nodeCount);
+    for (size_t i = 0; i < nodeCount; ++i)
+        positions[order[i]] = i;
+
+    for (size_t i = 0; i < nodeCount; ++i) {
+        auto node = pmxNodes[order[i]];
+        auto parent = node->GetParent();
+        nodes_.push_back(node);
+        parents_.push_back(parent ? positions[indices.at(parent)] : -1);
+        afterPhysics_.push_back(node->IsDeformAfterPhysics());
+        if (i + 1 == nodeCount || levels[order[i]] != levels[order[i + 1]])
+            levelEnds_.push_back(i + 1);
+    }
+
+    const auto getIndex = [&positions, &indices](const saba::MMDNode *node) {
+        return node ? positions[indices.at(node)] : -1;
+    };
+
+    // Subtrees in breadth first order, which visits parents before children.
+    std::vector<std::vector<int32_t>> children(nodeCount);
+    for (size_t i = 0; i < nodeCount; ++i) {
+        if (parents_[i] >= 0)
+            children[parents_[i]].push_back(i);
+    }
+    const auto addSubtree = [this, &children](int32_t root) {
+        const size_t begin = subtrees_.size();
+        if (root >= 0)
+            subtrees_.push_back(root);
+        for (size_t i = begin; i < subtrees_.size(); ++i) {
+            const auto& c = children[subtrees_[i]];
+            subtrees_.insert(subtrees_.end(), c.begin(), c.end());
+        }
+        return std::make_pair(begin, subtrees_.size());
+    };
+
+    translates_.resize(nodeCount);
+    rotates_.resize(nodeCount);
+    scales_.resize(nodeCount);
+    locals_.resize(nodeCount);
+    globals_.resize(nodeCount);
+
+    // The same order as saba sorts bones in.
+    std::vector<saba::PMXNode *> sortedNodes = pmxNodes;
+    std::stable_sort(
+        sortedNodes.begin(), sortedNodes.end(), [](saba::PMXNode *x, saba::PMXNode *y) {
+            return x->GetDeformDepth() < y->GetDeformDepth();
+        });
+
+    // IK chains, set up in the same way as saba::PMXModel::Load().
+    std::unordered_map<const saba::MMDIkSolver *, int32_t> chainIndices;
+    for (size_t i = 0; i < nodeCount; ++i) {
+        const auto& bone = pmx->m_bones[i];
+        const auto solver = pmxNodes[i]->GetIKSolver();
+        if (!solver || bone.m_ikTargetBoneIndex < 0 ||
+            static_cast<size_t>(bone.m_ikTargetBoneIndex) >= nodeCount)
+            continue;
+
+        const size_t linkBegin = ikLinks_.size();
+        for (const auto& link : bone.m_ikLinks) {
+            if (link.m_ikBoneIndex < 0 || static_cast<size_t>(link.m_ikBoneIndex) >= nodeCount)
+                continue;
+            ikLinks_.push_back({
+                .node = pmxNodes[link.m_ikBoneIndex],
+                .limited = link.m_enableLimit != 0,
+                .limitMin = link.m_limitMax * glm::vec3(-1),
+                .limitMax = link.m_limitMin * glm::vec3(-1),
+                .prevAngle = glm::vec3(0),
+                .planeAngle = 0.0f,
+                .solvedRotate = glm::quat(1, 0, 0, 0),
+            });
+        }
+
+        // The end effector moves with the bones between it and the root link
+        // as well as with the links.
+        const auto target = pmxNodes[bone.m_ikTargetBoneIndex];
+        const auto links = std::ranges::subrange(ikLinks_.begin() + linkBegin, ikLinks_.end());
+        const saba::MMDNode *rootParent =
+            links.empty() ? nullptr : ikLinks_.back().node->GetParent();
+        const size_t pathBegin = ikPaths_.size();
+        for (auto node = static_cast<saba::MMDNode *>(target); node && node != rootParent;
+             node = node->GetParent()) {
+            if (std::ranges::none_of(links, [node](const auto& l) { return l.node == node; }))
+                ikPaths_.push_back({.node = node, .lastLocal = glm::mat4(1)});
+        }
+
+        const auto [linkSubtreeBegin, linkSubtreeEnd] =
+            addSubtree(links.empty() ? -1 : getIndex(ikLinks_.back().node));
+        chainIndices.emplace(solver, ikChains_.size());
+        ikChains_.push_back({
+            .solver = solver,
+            .ikNode = pmxNodes[i],
+            .target = target,
+            .iterateCount = static_cast<uint32_t>(bone.m_ikIterationCount),
+            .limitAngle = bone.m_ikLimit,
+            .linkBegin = linkBegin,
+            .linkEnd = ikLinks_.size(),
+            .pathBegin = pathBegin,
+            .pathEnd = ikPaths_.size(),
+            .ikIndex = getIndex(pmxNodes[i]),
+            .targetIndex = getIndex(target),
+            .rootParentIndex = getIndex(rootParent),
+            .linkSubtreeBegin = linkSubtreeBegin,
+            .linkSubtreeEnd = linkSubtreeEnd,
+            .solved = false,
+            .solves = 0,
+            .skips = 0,
+            .iterations = 0,
+        });
+    }
+
+    for (auto node : sortedNodes) {
+        const auto solver = node->GetIKSolver();
+        const auto chain = chainIndices.find(solver);
+        Step step = {
+            .node = node,
+            .ikChain = chain == chainIndices.end() ? -1 : chain->second,
+            .index = getIndex(node),
+            .subtreeBegin = 0,
+            .subtreeEnd = 0,
+        };
+        if (node->IsDeformAfterPhysics()) {
+            afterPhysicsSteps_.push_back(step);
+        } else if (node->GetAppendNode() || solver) {
+            std::tie(step.subtreeBegin, step.subtreeEnd) = addSubtree(step.index);
+            appendIKSteps_.push_back(step);
+        }
+    }
+}
+
+void Skeleton::BeginAnimation(saba::MMDModel& model, bool morphsReplaced) {
+    if (!flattened_ || !morphsReplaced) {
+        model.BeginAnimation();
+        return;
+    }
+    for (auto node : nodes_)
+        node->BeginUpdateTransform();
+}
+
+void Skeleton::UpdateBeforePhysics(saba::MMDModel& model) {
+    if (!flattened_) {
+        model.UpdateNodeAnimation(false);
+        return;
+    }
+
+    // Gather animated TRS.  Append transforms are the ones of the last frame
+    // as in saba, and are identity for bones without append.
+    const size_t nodeCount = nodes_.size();
+    for (size_t i = 0; i < nodeCount; ++i) {
+        const auto node = nodes_[i];
+        translates_[i] = node->AnimateTranslate() + node->GetAppendTranslate();
+        glm::quat r = node->AnimateRotate();
+        if (node->IsIK())
+            r = node->GetIKRotate() * r;
+        rotates_[i] = r * node->GetAppendRotate();
+        scales_[i] = node->GetScale();
+    }
+
+    // Same as translate(t) * mat4_cast(r) * scale(s).  Bones deformed after
+    // physics keep their local transforms.
+    for (size_t i = 0; i < nodeCount; ++i) {
+        if (afterPhysics_[i]) {
+            locals_[i] = nodes_[i]->GetLocalTransform();
+            continue;
+        }
+        glm::mat4 m = glm::mat4_cast(rotates_[i]);
+        m[0] *= scales_[i].x;
+        m[1] *= scales_[i].y;
+        m[2] *= scales_[i].z;
+        m[3] = glm::vec4(translates_[i], 1.0f);
+        locals_[i] = m;
+        nodes_[i]->SetLocalTransform(m);
+    }
+    updateGlobalTransforms();
+
+    // Append transforms and IK depend on the global transforms of other
+    // bones, so they are evaluated in the order of deform depth.  The table
+    // keeps the global transforms meanwhile, which are written back at once.
+    for (const auto& step : appendIKSteps_) {
+        if (step.node->GetAppendNode() != nullptr) {
+            step.node->UpdateAppendTransform();
+            locals_[step.index] = step.node->GetLocalTransform();
+            updateSubtree(step.subtreeBegin, step.subtreeEnd);
+        }
+        if (step.ikChain >= 0) {
+            // The solver works on the nodes.  Give it the global transforms it
+            // reads, and take back the ones of the links and below it updates.
+            auto& chain = ikChains_[step.ikChain];
+            for (const int32_t i : {chain.ikIndex, chain.targetIndex, chain.rootParentIndex}) {
+                if (i >= 0)
+                    nodes_[i]->SetGlobalTransform(globals_[i]);
+            }
+            solveIK(chain);
+            if (chain.solved) {
+                for (size_t i = chain.linkSubtreeBegin; i < chain.linkSubtreeEnd; ++i) {
+                    const int32_t bone = subtrees_[i];
+                    locals_[bone] = nodes_[bone]->GetLocalTransform();
+                    globals_[bone] = nodes_[bone]->GetGlobalTransform();
+                }
+            }
+            updateSubtree(step.subtreeBegin, step.subtreeEnd);
+        }
+    }
+
+    for (size_t i = 0; i < nodeCount; ++i)
+        nodes_[i]->SetGlobalTransform(globals_[i]);
+}
+
+void Skeleton::UpdateAfterPhysics() {
+    // Same steps as saba::PMXModel::UpdateNodeAnimation().  Updating global
+    // transform also updates the descendants, so bones below these are
+    // re-evaluated as well.
+    for (const auto& step : afterPhysicsSteps_)
+        step.node->UpdateLocalTransform();
+    for (const auto& step : afterPhysicsSteps_) {
+        if (step.node->GetParent() == nullptr)
+            step.node->UpdateGlobalTransform();
+    }
+    runSteps(afterPhysicsSteps_);
+    for (const auto& step : afterPhysicsSteps_) {
+        if (step.node->GetParent() == nullptr)
+            step.node->UpdateGlobalTransform();
+    }
+}
+
+std::vector<Skeleton::IKStats> Skeleton::GetIKStats() const {
+    std::vector<IKStats> stats;
+    for (const auto& chain : ikChains_) {
+        stats.push_back({
+            .name = chain.ikNode->GetName(),
+            .solves = chain.solves,
+            .skips = chain.skips,
+            .iterations = chain.iterations,
+        });
+    }
+    return stats;
+}
+
+void Skeleton::ResetIKStats() {
+    for (auto& chain : ikChains_) {
+        chain.solves = 0;
+        chain.skips = 0;
+        chain.iterations = 0;
+    }
+}
+
+void Skeleton::runSteps(const std::vector<Step>& steps) {
+    for (const auto& step : steps) {
+        if (step.node->GetAppendNode() != nullptr) {
+            step.node->UpdateAppendTransform();
+            step.node->UpdateGlobalTransform();
+        }
+        if (step.ikChain >= 0) {
+            solveIK(ikChains_[step.ikChain]);
+            step.node->UpdateGlobalTransform();
+        }
+    }
+}
+
+void Skeleton::solveIK(IKChain& chain) {
+    // Leave the links as they are while disabled, as saba does.
+    if (!chain.solver->Enabled()) {
+        chain.solved = false;
+        return;
+    }
+
+    // The solution of the last frame is the solution for the same inputs.
+    const bool unchanged = isIKInputUnchanged(chain);
+    if (chain.solved)
+        applySolvedIK(chain);
+    if (unchanged) {
+        ++chain.skips;
+        return;
+    }
+    ++chain.solves;
+
+    const auto links = ikLinks_.begin();
+    if (!chain.solved) {
+        for (size_t i = chain.linkBegin; i < chain.linkEnd; ++i) {
+            auto& link = links[i];
+            link.prevAngle = glm::vec3(0);
+            link.planeAngle = 0.0f;
+            link.node->SetIKRotate(glm::quat(1, 0, 0, 0));
+            link.node->UpdateLocalTransform();
+            link.node->UpdateGlobalTransform();
+        }
+    }
+
+    // Otherwise start from the solution of the last frame, which usually
+    // needs only a few iterations to follow the goal.  The limit state of the
+    // links is the one of that solution.
+    const auto saveLinks = [&chain, &links]() {
+        for (size_t i = chain.linkBegin; i < chain.linkEnd; ++i) {
+            auto& link = links[i];
+            link.savedRotate = link.node->GetIKRotate();
+            link.savedPrevAngle = link.prevAngle;
+            link.savedPlaneAngle = link.planeAngle;
+        }
+    };
+    float minDist = glm::distance(getPosition(chain.ikNode), getPosition(chain.target));
+    saveLinks();
+
+    for (uint32_t iteration = 0; iteration < chain.iterateCount; ++iteration) {
+        if (minDist < ikErrorThreshold)
+            break;
+
+        ++chain.iterations;
+        for (size_t i = chain.linkBegin; i < chain.linkEnd; ++i) {
+            auto& link = links[i];
+            if (link.node == chain.target)
+                continue;
+            solveIKLink(chain, link, iteration);
+        }
+
+        const float dist = glm::distance(getPosition(chain.ikNode), getPosition(chain.target));
+        if (dist < minDist) {
+            minDist = dist;
+            saveLinks();
+        } else {
+            for (size_t i = chain.linkBegin; i < chain.linkEnd; ++i) {
+                auto& link = links[i];
+                link.prevAngle = link.savedPrevAngle;
+                link.planeAngle = link.savedPlaneAngle;
+                link.node->SetIKRotate(link.savedRotate);
+                link.node->UpdateLocalTransform();
+                link.node->UpdateGlobalTransform();
+            }
+            break;
+        }
+    }
+    for (size_t i = chain.linkBegin; i < chain.linkEnd; ++i)
+        links[i].solvedRotate = links[i].node->GetIKRotate();
+    chain.solved = true;
+}
+
+void Skeleton::applySolvedIK(const IKChain& chain) {
+    // From the root link, so that each link is placed under its moved parent.
+    for (size_t i = chain.linkEnd; i > chain.linkBegin; --i) {
+        auto& link = ikLinks_[i - 1];
+        link.node->SetIKRotate(link.solvedRotate);
+        link.node->UpdateLocalTransform();
+        link.node->UpdateGlobalTransform();
+    }
+}
+
+bool Skeleton::isIKInputUnchanged(IKChain& chain) {
+    // The chain depends on the goal, the bone above the chain, the animation
+    // of the links and the bones between the links and the end effector.
+    bool unchanged = chain.solved;
+
+    const glm::vec3 goal = getPosition(chain.ikNode);
+    unchanged = unchanged && goal == chain.lastGoal;
+    chain.lastGoal = goal;
+
+    if (chain.linkBegin != chain.linkEnd) {
+        const auto root = ikLinks_[chain.linkEnd - 1].node->GetParent();
+        const glm::mat4 rootTransform = root ? root->GetGlobalTransform() : glm::mat4(1);
+        unchanged = unchanged && rootTransform == chain.lastRoot;
+        chain.lastRoot = rootTransform;
+    }
+
+    // The local transforms of the links contain their IK rotations, so their
+    // inputs are compared instead.
+    for (size_t i = chain.linkBegin; i < chain.linkEnd; ++i) {
+        auto& link = ikLinks_[i];
+        const glm::vec3 t = link.node->AnimateTranslate() + link.node->GetAppendTranslate();
+        const glm::quat r = link.node->AnimateRotate() * link.node->GetAppendRotate();
+        unchanged = unchanged && t == link.lastTranslate && r == link.lastRotate;
+        link.lastTranslate = t;
+        link.lastRotate = r;
+    }
+    for (size_t i = chain.pathBegin; i < chain.pathEnd; ++i) {
+        auto& path = ikPaths_[i];
+        const glm::mat4& local = path.node->GetLocalTransform();
+        unchanged = unchanged && local == path.lastLocal;
+        path.lastLocal = local;
+    }
+    return unchanged;
+}
+
+void Skeleton::solveIKLink(IKChain& chain, IKLink& link, uint32_t iteration) {
+    // Links which rotate around only one axis are solved on a plane.
+    if (link.limited) {
+        const auto& min = link.limitMin;
+        const auto& max = link.limitMax;
+        if ((min.x != 0 || max.x != 0) && (min.y == 0 || max.y == 0) &&
+            (min.z == 0 || max.z == 0)) {
+            solveIKLinkPlane(chain, link, iteration, 0);
+            return;
+        } else if (
+            (min.y != 0 || max.y != 0) && (min.x == 0 || max.x == 0) &&
+            (min.z == 0 || max.z == 0)) {
+            solveIKLinkPlane(chain, link, iteration, 1);
+            return;
+        } else if (
+            (min.z != 0 || max.z != 0) && (min.x == 0 || max.x == 0) &&
+            (min.y == 0 || max.y == 0)) {
+            solveIKLinkPlane(chain, link, iteration, 2);
+            return;
+        }
+    }
+
+    const auto node = link.node;
+    const glm::mat4 invChain = glm::inverse(node->GetGlobalTransform());
+    const glm::vec3 ikVec =
+        glm::normalize(glm::vec3(invChain * glm::vec4(getPosition(chain.ikNode), 1)));
+    const glm::vec3 targetVec =
+        glm::normalize(glm::vec3(invChain * glm::vec4(getPosition(chain.target), 1)));
+
+    float angle = std::acos(glm::clamp(glm::dot(targetVec, ikVec), -1.0f, 1.0f));
+    if (glm::degrees(angle) < 1.0e-3f)
+        return;
+    angle = glm::clamp(angle, -chain.limitAngle, chain.limitAngle);
+
+    const glm::vec3 cross = glm::normalize(glm::cross(targetVec, ikVec));
+    glm::quat rotate =
+        node->GetIKRotate() * node->AnimateRotate() * glm::angleAxis(angle, cross);
+    if (link.limited) {
+        const glm::vec3 angles = decompose(glm::mat3_cast(rotate), link.prevAngle);
+        glm::vec3 clamped = glm::clamp(angles, link.limitMin, link.limitMax);
+        clamped = glm::clamp(clamped - link.prevAngle, -chain.limitAngle, chain.limitAngle) +
+                  link.prevAngle;
+        glm::quat r = glm::angleAxis(clamped.x, glm::vec3(1, 0, 0));
+        r = r * glm::angleAxis(clamped.y, glm::vec3(0, 1, 0));
+        r = r * glm::angleAxis(clamped.z, glm::vec3(0, 0, 1));
+        link.prevAngle = clamped;
+        rotate = glm::quat_cast(glm::mat3_cast(r));
+    }
+
+    node->SetIKRotate(rotate * glm::inverse(node->AnimateRotate()));
+    node->UpdateLocalTransform();
+    node->UpdateGlobalTransform();
+}
+
+void Skeleton::solveIKLinkPlane(IKChain& chain, IKLink& link, uint32_t iteration, int axis) {
+    glm::vec3 rotateAxis(0);
+    rotateAxis[axis] = 1.0f;
+
+    const auto node = link.node;
+    const glm::mat4 invChain = glm::inverse(node->GetGlobalTransform());
+    const glm::vec3 ikVec =
+        glm::normalize(glm::vec3(invChain * glm::vec4(getPosition(chain.ikNode), 1)));
+    const glm::vec3 targetVec =
+        glm::normalize(glm::vec3(invChain * glm::vec4(getPosition(chain.target), 1)));
+
+    float angle = std::acos(glm::clamp(glm::dot(targetVec, ikVec), -1.0f, 1.0f));
+    angle = glm::clamp(angle, -chain.limitAngle, chain.limitAngle);
+
+    const float dot1 = glm::dot(glm::angleAxis(angle, rotateAxis) * targetVec, ikVec);
+    const float dot2 = glm::dot(glm::angleAxis(-angle, rotateAxis) * targetVec, ikVec);
+    float newAngle = link.planeAngle + (dot1 > dot2 ? angle : -angle);
+
+    const float min = link.limitMin[axis];
+    const float max = link.limitMax[axis];
+    if (iteration == 0 && (newAngle < min || newAngle > max)) {
+        if (-newAngle > min && -newAngle < max) {
+            newAngle *= -1;
+        } else {
+            const float half = (min + max) * 0.5f;
+            if (std::abs(half - newAngle) > std::abs(half + newAngle))
+                newAngle *= -1;
+        }
+    }
+    newAngle = glm::clamp(newAngle, min, max);
+    link.planeAngle = newAngle;
+
+    const glm::quat rotate = glm::angleAxis(newAngle, rotateAxis);
+    node->SetIKRotate(rotate * glm::inverse(node->AnimateRotate()));
+    node->UpdateLocalTransform();
+    node->UpdateGlobalTransform();
+}
+
+void Skeleton::updateGlobalTransforms() {
+    // Bones in a level depend only on the levels above, so each level can be
+    // processed in any order.
+    size_t begin = 0;
+    for (const size_t end : levelEnds_) {
+        for (size_t i = begin; i < end; ++i) {
+            const int32_t parent = parents_[i];
+            globals_[i] = parent < 0 ? locals_[i] : globals_[parent] * locals_[i];
+        }
+        begin = end;
+    }
+}
+
+void Skeleton::updateSubtree(size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+        const int32_t bone = subtrees_[i];
+        const int32_t parent = parents_[bone];
+        globals_[bone] = parent < 0 ? locals_[bone] : globals_[parent] * locals_[bone];
+    }
+}
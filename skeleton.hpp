@@ -0,0 +1,163 @@
+#ifndef SKELETON_HPP_
+#define SKELETON_HPP_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "Saba/Model/MMD/MMDIkSolver.h"
+#include "Saba/Model/MMD/MMDModel.h"
+#include "Saba/Model/MMD/PMXFile.h"
+#include "Saba/Model/MMD/PMXNode.h"
+#include "glm/glm.hpp"
+#include "glm/gtc/quaternion.hpp"
+
+// Bones of a model flattened into a table at load time.  The table is sorted
+// by the depth in the hierarchy so that parents always come before their
+// children, and bones in the same level don't depend on each other.  Node
+// updates run as linear sweeps over the contiguous arrays instead of
+// recursion over saba's pointer-linked tree, and the results are written back
+// to saba's nodes for skinning, physics and IK.
+class Skeleton {
+public:
+    struct IKStats {
+        std::string name;
+        size_t solves;
+        size_t skips;  // Solves skipped because nothing moved.
+        size_t iterations;
+    };
+
+public:
+    Skeleton();
+
+    // "pmx" is the file the model is loaded from, or nullptr for PMD models.
+    void Init(saba::MMDModel& model, const saba::PMXFile *pmx);
+
+    // Replacement of saba::MMDModel::BeginAnimation().  saba also clears its
+    // morph buffers of all the vertices, which is skipped when
+    // "morphsReplaced", i.e. MorphSet is enabled and leaves them unused.
+    // Otherwise saba's morphs would add up over frames.
+    void BeginAnimation(saba::MMDModel& model, bool morphsReplaced);
+
+    // Replacement of saba::MMDModel::UpdateNodeAnimation(false).  Falls back
+    // to saba for PMD models.
+    void UpdateBeforePhysics(saba::MMDModel& model);
+
+    // Replacement of saba::MMDModel::UpdateNodeAnimation(true).  saba walks
+    // all the bones four times to find the few ones deformed after physics,
+    // while this walks only those bones.
+    void UpdateAfterPhysics();
+
+    std::vector<IKStats> GetIKStats() const;
+    void ResetIKStats();
+
+private:
+    struct IKLink {
+        saba::PMXNode *node;
+        bool limited;
+        glm::vec3 limitMin;
+        glm::vec3 limitMax;
+        glm::vec3 prevAngle;
+        float planeAngle;
+
+        // State at the best iteration of the current solve.
+        glm::quat savedRotate;
+        glm::vec3 savedPrevAngle;
+        float savedPlaneAngle;
+
+        // IK rotation of the last solve.  saba resets IK rotations every frame
+        // in BeginUpdateTransform(), so this is applied again to reuse the
+        // solution or to start from it.
+        glm::quat solvedRotate;
+
+        // Inputs of the last solve.
+        glm::vec3 lastTranslate;
+        glm::quat lastRotate;
+    };
+
+    // A bone other than the links between the root of an IK chain and its end
+    // effector, including the end effector itself.
+    struct IKPathNode {
+        saba::MMDNode *node;
+        glm::mat4 lastLocal;  // Local transform at the last solve.
+    };
+
+    // An IK chain solved by CCD in the same way as saba::MMDIkSolver.  In
+    // addition, a solve is skipped when nothing the chain depends on has
+    // moved, starts from the solution of the previous frame, and stops once
+    // the error gets under a threshold.
+    struct IKChain {
+        saba::MMDIkSolver *solver;  // For the enabled state animated by VMD.
+        saba::MMDNode *ikNode;      // The goal.
+        saba::MMDNode *target;      // The end effector.
+        uint32_t iterateCount;
+        float limitAngle;
+        size_t linkBegin;  // Range in ikLinks_.
+        size_t linkEnd;
+        size_t pathBegin;  // Range in ikPaths_.
+        size_t pathEnd;
+
+        // Indices in the bone table of the bones the solver reads global
+        // transforms of before it updates the links, or -1.
+        int32_t ikIndex;
+        int32_t targetIndex;
+        int32_t rootParentIndex;
+        size_t linkSubtreeBegin;  // Range in subtrees_ of the root link and below.
+        size_t linkSubtreeEnd;
+
+        // Whether IKLink::solvedRotate of the links hold a solution of this
+        // chain, which can be reused or warm-started from.
+        bool solved;
+        glm::vec3 lastGoal;
+        glm::mat4 lastRoot;
+
+        size_t solves;
+        size_t skips;
+        size_t iterations;
+    };
+
+    // A bone to evaluate append transform or IK of.
+    struct Step {
+        saba::PMXNode *node;
+        int32_t ikChain;      // Index in ikChains_, or -1.
+        int32_t index;        // Index in the bone table.
+        size_t subtreeBegin;  // Range in subtrees_ of the bone and below.
+        size_t subtreeEnd;
+    };
+
+    void runSteps(const std::vector<Step>& steps);
+    void solveIK(IKChain& chain);
+    bool isIKInputUnchanged(IKChain& chain);
+    void applySolvedIK(const IKChain& chain);
+    void solveIKLink(IKChain& chain, IKLink& link, uint32_t iteration);
+    void solveIKLinkPlane(IKChain& chain, IKLink& link, uint32_t iteration, int axis);
+
+    // Calculate global transforms in the table from local transforms level by
+    // level.
+    void updateGlobalTransforms();
+    void updateSubtree(size_t begin, size_t end);
+
+    bool flattened_;
+
+    // The bone table.
+    std::vector<saba::PMXNode *> nodes_;
+    std::vector<int32_t> parents_;  // Index in the table, or -1 for roots.
+    std::vector<uint8_t> afterPhysics_;
+    std::vector<size_t> levelEnds_;
+    std::vector<glm::vec3> translates_;
+    std::vector<glm::quat> rotates_;
+    std::vector<glm::vec3> scales_;
+    std::vector<glm::mat4> locals_;
+    std::vector<glm::mat4> globals_;
+    std::vector<int32_t> subtrees_;  // Bones in ranges of subtrees, parents first.
+
+    // Bones with append transform or IK deformed before physics, and bones
+    // deformed after physics, both in the order of deform depth.
+    std::vector<Step> appendIKSteps_;
+    std::vector<Step> afterPhysicsSteps_;
+
+    std::vector<IKChain> ikChains_;
+    std::vector<IKLink> ikLinks_;
+    std::vector<IKPathNode> ikPaths_;
+};
+
+#endif  // SKELETON_HPP_
@@ -1,6 +1,7 @@
 #ifndef UTIL_HPP_
 #define UTIL_HPP_
 
+#include <chrono>
 #include <cstdlib>
 #include <filesystem>
 #include <iostream>
@@ -92,6 +93,21 @@ inline constexpr std::underlying_type_t<T> underlyCast(T v) {
 }
 }  // namespace Enum
 
+namespace Benchmark {
+// The average milliseconds "run" takes over a few runs, so that a single run's
+// noise doesn't dominate.
+template <typename F>
+double MeasureMs(F&& run) {
+    constexpr int repeat = 4;
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < repeat; ++i)
+        run();
+    const std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return elapsed.count() / repeat;
+}
+}  // namespace Benchmark
+
 namespace Path {
 std::filesystem::path getWorkingDirectory();
 std::filesystem::path makeAbsolute(
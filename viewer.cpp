@@ -1,26 +1,40 @@
 #include "viewer.hpp"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <charconv>
+#include <cmath>
+#include <cstddef>
 #include <ctime>
 #include <filesystem>
 #include <functional>
+#include <initializer_list>
+#include <limits>
 #include <memory>
 #include <numbers>
 #include <numeric>
 #include <optional>
 #include <random>
+#include <span>
 #include <string>
 #include <string_view>
+#include <thread>
 #include "Saba/Model/MMD/MMDCamera.h"
 #include "Saba/Model/MMD/MMDMaterial.h"
 #include "Saba/Model/MMD/MMDModel.h"
 #include "Saba/Model/MMD/MMDPhysics.h"
 #include "Saba/Model/MMD/PMDModel.h"
+#include "Saba/Model/MMD/PMXFile.h"
 #include "Saba/Model/MMD/PMXModel.h"
-#include "Saba/Model/MMD/VMDAnimation.h"
 #include "Saba/Model/MMD/VMDCameraAnimation.h"
 #include "Saba/Model/MMD/VMDFile.h"
+#include "allocator.hpp"
+#include "atlas.hpp"
+#include "bcn.hpp"
 #include "btBulletDynamicsCommon.h"  // IWYU pragma: keep; supress warning from clangd.
 #include "constant.hpp"
 #include "keyboard.hpp"
+#include "physics.hpp"
 #include "platform.hpp"
 #include "platform_api.hpp"
 #include "sokol_gfx.h"
@@ -30,6 +44,10 @@
 #include "auto/yommd.glsl.h"
 
 namespace {
+// Vertex buffer slots of the MMD pipeline.
+constexpr int vertexBufferIndex = 0;  // Interleaved positions and normals.
+constexpr int uvBufferIndex = 1;
+
 const std::filesystem::path getXdgConfigHomePath() {
 #ifdef PLATFORM_WINDOWS
     const wchar_t *wpath = _wgetenv(L"XDG_CONFIG_HOME");
@@ -51,6 +69,89 @@ inline glm::vec3 toVec3(glm::vec2 xy, decltype(xy)::value_type z) {
     return glm::vec3(xy.x, xy.y, z);
 }
 
+// FNV-1a hash.
+uint64_t hashBytes(uint64_t hash, const void *data, size_t size) {
+    const auto bytes = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+uint64_t hashFile(uint64_t hash, const std::filesystem::path& path) {
+    std::error_code err;
+    const auto str = path.u8string();
+    const uintmax_t size = std::filesystem::file_size(path, err);
+    const auto mtime = std::filesystem::last_write_time(path, err).time_since_epoch().count();
+    hash = hashBytes(hash, str.data(), str.size());
+    hash = hashBytes(hash, &size, sizeof(size));
+    return hashBytes(hash, &mtime, sizeof(mtime));
+}
+
+sg_pixel_format toPixelFormat(BCn::Format format) {
+    switch (format) {
+    case BCn::Format::BC1:
+        return SG_PIXELFORMAT_BC1_RGBA;
+    case BCn::Format::BC3:
+        return SG_PIXELFORMAT_BC3_RGBA;
+    case BCn::Format::BC7:
+        return SG_PIXELFORMAT_BC7_RGBA;
+    }
+    return SG_PIXELFORMAT_RGBA8;
+}
+
+// Select the block compressed formats the backend can sample, for images
+// without and with alpha each, in the order of preference.
+BlockFormats selectBlockFormats() {
+    const auto select = [](std::span<const BCn::Format> candidates) {
+        for (const auto format : candidates) {
+            if (sg_query_pixelformat(toPixelFormat(format)).sample)
+                return std::optional(format);
+        }
+        return std::optional<BCn::Format>();
+    };
+    static constexpr std::array opaqueFormats = {BCn::Format::BC1};
+    static constexpr std::array alphaFormats = {BCn::Format::BC7, BCn::Format::BC3};
+    return {.opaque = select(opaqueFormats), .alpha = select(alphaFormats)};
+}
+
+// Whether "a" and "b" bind the same textures.  The other bindings of the MMD
+// pipelines are the same all the time.
+bool isSameViews(const sg_bindings& a, const sg_bindings& b) {
+    constexpr std::array views = {VIEW_u_Tex, VIEW_u_SphereTex, VIEW_u_ToonTex};
+    return std::ranges::all_of(
+        views, [&](int view) { return a.views[view].id == b.views[view].id; });
+}
+
+// The path in "pathByHash" of a file of the content "data", whose hash is
+// "hash".  Files of the same hash are read to compare in case hashes collide.
+std::optional<std::string> findSameContent(
+    const std::multimap<uint64_t, std::string>& pathByHash,
+    uint64_t hash,
+    const std::vector<uint8_t>& data) {
+    const auto [begin, end] = pathByHash.equal_range(hash);
+    for (auto itr = begin; itr != end; ++itr) {
+        if (Image::hasContent(itr->second, data))
+            return itr->second;
+    }
+    return std::nullopt;
+}
+
+// Bytes of the pixels of the image including its mipmaps.
+size_t getImageBytes(const Image& image) {
+    if (image.blockFormat) {
+        size_t bytes = 0;
+        for (const auto& level : image.blocks)
+            bytes += level.size();
+        return bytes;
+    }
+    size_t bytes = image.pixels.size();
+    for (const auto& mipmap : image.mipmaps)
+        bytes += mipmap.size();
+    return bytes;
+}
+
 }  // namespace
 
 SgImageView::SgImageView() {}
@@ -93,15 +194,39 @@ const sg_view& SgImageView::getView() const {
     return container_->view;
 }
 
-Material::Material(const saba::MMDMaterial& mat) : material(mat), textureHasAlpha(false) {}
+Material::Material(const saba::MMDMaterial& mat) :
+    material(mat),
+    textureAlpha(AlphaUsage::Opaque),
+    textureTransform(1.0f, 1.0f, 0.0f, 0.0f),
+    spTextureTransform(1.0f, 1.0f, 0.0f, 0.0f) {}
+
+AlphaUsage Material::GetAlphaUsage() const {
+    if (material.m_alpha < 1.0f)
+        return AlphaUsage::Blended;
+    return texture ? textureAlpha : AlphaUsage::Opaque;
+}
 
 void MMD::LoadModel(
     const std::filesystem::path& modelPath,
     const std::filesystem::path& resourcePath) {
     const auto ext = std::filesystem::path(modelPath).extension();
+
+    // saba doesn't keep the IK parameters of the bones, which the skeleton
+    // needs to solve IK by itself, nor the morphs and weights of the file.
+    // PMXModel::Load() only takes a path, so the file is parsed twice; the
+    // second parse runs on a thread while saba builds the model, so that it
+    // costs about nothing on multi-core machines.
+    std::unique_ptr<saba::PMXFile> pmxFile(nullptr);
     if (ext == ".pmx") {
+        pmxFile = std::make_unique<saba::PMXFile>();
+        bool fileRead = false;
+        std::thread reader([&pmxFile, &fileRead, &modelPath] {
+            fileRead = saba::ReadPMXFile(pmxFile.get(), modelPath.string().c_str());
+        });
         auto pmx = std::make_unique<saba::PMXModel>();
-        if (!pmx->Load(modelPath.string(), resourcePath.string())) {
+        const bool modelLoaded = pmx->Load(modelPath.string(), resourcePath.string());
+        reader.join();
+        if (!modelLoaded || !fileRead) {
             Err::Exit("Failed to load PMX:", modelPath);
         }
         model_ = std::move(pmx);
@@ -116,23 +241,28 @@ void MMD::LoadModel(
     }
 
     model_->InitializeAnimation();
+
+    // By default saba skins vertices on threads started by std::async() in
+    // every Update(), which creates threads and allocates their shared states
+    // every frame.
+    model_->SetParallelUpdateHint(1);
+
+    skeleton_.Init(*model_, pmxFile.get());
+    morphs_.Init(*model_, pmxFile.get());
+    mesh_.Init(*model_, pmxFile.get(), morphs_);
+    motionTargets_.Init(*model_);
 }
 
 void MMD::LoadMotion(const std::vector<std::filesystem::path>& paths) {
     std::unique_ptr<saba::VMDCameraAnimation> cameraAnim(nullptr);
-    auto vmdAnim = std::make_unique<saba::VMDAnimation>();
-    if (!vmdAnim->Create(model_)) {
-        Err::Exit("Failed to create VMDAnimation");
-    }
+    auto vmdAnim = std::make_unique<Motion>(motionTargets_);
 
     for (const auto& p : paths) {
         saba::VMDFile vmdFile;
         if (!saba::ReadVMDFile(&vmdFile, p.string().c_str())) {
             Err::Exit("Failed to read VMD file:", p);
         }
-        if (!vmdAnim->Add(vmdFile)) {
-            Err::Exit("Failed to add VMDAnimation:", p);
-        }
+        vmdAnim->Add(vmdFile);
 
         if (!vmdFile.m_cameras.empty()) {
             cameraAnim = std::make_unique<saba::VMDCameraAnimation>();
@@ -141,6 +271,7 @@ void MMD::LoadMotion(const std::vector<std::filesystem::path>& paths) {
         }
     }
 
+    morphs_.AddAnimatedMorphs(vmdAnim->GetAnimatedMorphs());
     animations_.push_back(std::make_pair(std::move(vmdAnim), std::move(cameraAnim)));
 }
 
@@ -156,6 +287,18 @@ const std::vector<MMD::Animation>& MMD::GetAnimations() const {
     return animations_;
 }
 
+Skeleton& MMD::GetSkeleton() {
+    return skeleton_;
+}
+
+MorphSet& MMD::GetMorphs() {
+    return morphs_;
+}
+
+Mesh& MMD::GetMesh() {
+    return mesh_;
+}
+
 // ModelEmphasizer::Init() and ModelEmphasizer::Draw() is based on quad-sapp in
 // sokol-samples, which published under MIT License.
 // https://github.com/floooh/sokol-samples/blob/801de1f6ef8acc7f824efe259293eb88a4476479/sapp/quad-sapp.c
@@ -412,8 +555,14 @@ Routine::Routine() :
     passAction_(
         {.colors = {{.load_action = SG_LOADACTION_CLEAR, .clear_value = {0, 0, 0, 0}}}}),
     binds_({}),
+    dedupedBytes_(0),
+    streamingTextures_(false),
+    timeBeginStreaming_(0),
     timeBeginAnimation_(0),
     timeLastFrame_(0),
+    timeLastStats_(0),
+    statsFrames_(0),
+    phaseTimes_({}),
     motionID_(0),
     needBridgeMotions_(false),
     rand_(static_cast<int>(std::time(nullptr))) {
@@ -432,13 +581,31 @@ void Routine::Init() {
 
     defaultCamera_.eye = config_.defaultCameraPosition;
     defaultCamera_.center = config_.defaultGazePosition;
+
+    // Bullet objects are made while loading the model.
+    Allocator::Install();
     mmd_.LoadModel(config_.model, resourcePath);
+    mmd_.GetMesh().SetDualQuaternion(config_.dualQuaternionSkinning);
 
+    const bool reduceKeyframes = config_.keyframeRotationTolerance > 0.0f ||
+                                 config_.keyframeTranslationTolerance > 0.0f;
     for (const auto& motion : config_.motions) {
         if (!motion.disabled) {
             mmd_.LoadMotion(motion.paths);
             motionWeights_.push_back(motion.weight);
+            if (reduceKeyframes)
+                reduceMotion(mmd_.GetAnimations().size() - 1);
+        }
+    }
+    if (config_.vertexCacheSize != 0) {
+        // Frames are sampled at Constant::VertexCacheFPS up to the last key.
+        constexpr double step = Constant::VertexCacheFPS / Constant::VmdFPS;
+        std::vector<uint32_t> frameCounts;
+        for (const auto& [motion, _] : mmd_.GetAnimations()) {
+            frameCounts.push_back(
+                static_cast<uint32_t>(std::floor(motion->GetMaxKeyTime() * step)) + 1);
         }
+        mmd_.GetMesh().InitCache(frameCounts, config_.vertexCacheSize);
     }
 
     const sg_desc desc = {
@@ -460,9 +627,8 @@ void Routine::Init() {
     modelEmphasizer_.Init();
 
     binds_.index_buffer = ibo_;
-    binds_.vertex_buffers[ATTR_mmd_in_Pos] = posVB_;
-    binds_.vertex_buffers[ATTR_mmd_in_Nor] = normVB_;
-    binds_.vertex_buffers[ATTR_mmd_in_UV] = uvVB_;
+    binds_.vertex_buffers[vertexBufferIndex] = vertexVB_;
+    binds_.vertex_buffers[uvBufferIndex] = uvVB_;
 
     const auto distSup = std::reduce(motionWeights_.cbegin(), motionWeights_.cend(), 0u);
     if (!motionWeights_.empty() && distSup == 0)
@@ -473,34 +639,107 @@ void Routine::Init() {
     physics->SetMaxSubStepCount(INT_MAX);
     physics->SetFPS(config_.simulationFPS);
     updateGravity();
+    initPhysicsSnapshots();
+    physicsLOD_.Init(*mmd_.GetModel(), config_.simulationFPS);
 
     userView_.SetDefaultTranslation(config_.defaultModelPosition);
     userView_.SetDefaultScaling(config_.defaultScale);
 
     selectNextMotion();
-    needBridgeMotions_ = false;
-    timeBeginAnimation_ = timeLastFrame_ = stm_now();
+    warmStartMotion();
+    if (config_.statsInterval > 0.0f)
+        reportSkinning();
+    timeLastStats_ = stm_now();
     shouldTerminate_ = true;
 }
 
+void Routine::initPhysicsSnapshots() {
+    // Motions are settled when they are first started, so that the first
+    // frame doesn't wait for all of them.
+    const auto& animations = mmd_.GetAnimations();
+    physicsSnapshots_.assign(animations.size(), std::nullopt);
+    physicsSnapshotPaths_.clear();
+    if (!config_.physicsSnapshotCache.has_value())
+        return;
+
+    // Everything the settled state depends on except the motion itself.
+    const size_t bodyCount = mmd_.GetModel()->GetPhysicsManager()->GetRigidBodys()->size();
+    uint64_t baseKey = hashFile(0xcbf29ce484222325, config_.model);
+    const std::array<float, 4> params = {
+        config_.simulationFPS,
+        config_.gravity,
+        static_cast<float>(Constant::PhysicsSettleBlendFrames),
+        static_cast<float>(Constant::PhysicsSettleHoldFrames),
+    };
+    baseKey = hashBytes(baseKey, params.data(), sizeof(params));
+    baseKey = hashBytes(baseKey, &bodyCount, sizeof(bodyCount));
+
+    for (const auto& motion : config_.motions) {
+        if (motion.disabled)
+            continue;
+        uint64_t key = baseKey;
+        for (const auto& path : motion.paths)
+            key = hashFile(key, path);
+
+        std::array<char, 16> name;
+        const auto result = std::to_chars(name.data(), name.data() + name.size(), key, 16);
+        const std::string fileName = std::string(name.data(), result.ptr) + ".physics";
+        physicsSnapshotPaths_.push_back(*config_.physicsSnapshotCache / fileName);
+    }
+}
+
+const PhysicsSnapshot& Routine::getPhysicsSnapshot(size_t motionID) {
+    auto& snapshot = physicsSnapshots_[motionID];
+    if (snapshot.has_value())
+        return *snapshot;
+    snapshot.emplace();
+
+    const auto model = mmd_.GetModel();
+    const size_t bodyCount = model->GetPhysicsManager()->GetRigidBodys()->size();
+    const bool cached = !physicsSnapshotPaths_.empty();
+    if (cached && snapshot->Load(physicsSnapshotPaths_[motionID], bodyCount))
+        return *snapshot;
+
+    // Blend from the bind pose into the first frame of the motion gradually,
+    // then let physics settle there, in full detail as a cached one is.
+    physicsLOD_.Reset(*model);
+    auto& skeleton = mmd_.GetSkeleton();
+    const auto& vmdAnim = mmd_.GetAnimations()[motionID].first;
+    model->InitializeAnimation();
+    model->SaveBaseAnimation();
+    for (int f = 0; f < Constant::PhysicsSettleBlendFrames + Constant::PhysicsSettleHoldFrames;
+         ++f) {
+        const float weight =
+            std::min(1.0f, static_cast<float>(f + 1) / Constant::PhysicsSettleBlendFrames);
+        skeleton.BeginAnimation(*model, mmd_.GetMorphs().IsEnabled());
+        vmdAnim->Evaluate(0.0f, weight);
+        mmd_.GetMorphs().Update(*model);
+        skeleton.UpdateBeforePhysics(*model);
+        model->UpdatePhysicsAnimation(1.0f / Constant::VmdFPS);
+        skeleton.UpdateAfterPhysics();
+        model->EndAnimation();
+    }
+    snapshot->Capture(*model);
+    model->InitializeAnimation();
+
+    if (cached) {
+        const auto& path = physicsSnapshotPaths_[motionID];
+        std::error_code err;
+        std::filesystem::create_directories(path.parent_path(), err);
+        if (!snapshot->Save(path))
+            Err::Log("Failed to save physics snapshot:", path);
+    }
+    return *snapshot;
+}
+
 void Routine::initBuffers() {
     const auto model = mmd_.GetModel();
     const size_t vertCount = model->GetVertexCount();
     const size_t indexSize = model->GetIndexElementSize();
 
-    posVB_ = sg_make_buffer(
-        sg_buffer_desc{
-            .size = vertCount * sizeof(glm::vec3),
-            .usage =
-                {
-                    .vertex_buffer = true,
-                    .immutable = false,
-                    .dynamic_update = true,
-                },
-        });
-    normVB_ = sg_make_buffer(
+    vertexVB_ = sg_make_buffer(
         sg_buffer_desc{
-            .size = vertCount * sizeof(glm::vec3),
+            .size = vertCount * sizeof(Mesh::Vertex),
             .usage =
                 {
                     .vertex_buffer = true,
@@ -572,59 +811,131 @@ void Routine::initTextures() {
 
     const auto& model = mmd_.GetModel();
     const size_t subMeshCount = model->GetSubMeshCount();
+    if (config_.textureCompression) {
+        blockFormats_ = selectBlockFormats();
+        blockFormats_.measurePSNR = config_.statsInterval > 0.0f;
+    }
+    const bool streaming = config_.textureStreaming && config_.textureBudget == 0;
+    if (config_.textureStreaming && !streaming)
+        Info::Log("Texture streaming is disabled since the texture budget is set");
+    if (!streaming) {
+        // Decode the files at once on threads.  Embedded toons are decoded already.
+        std::vector<std::string> paths;
+        for (size_t i = 0; i < subMeshCount; ++i) {
+            const auto& mmdMaterial = mmd_.GetMorphs().GetMaterials()[i];
+            for (const auto& path :
+                 {mmdMaterial.m_texture, mmdMaterial.m_spTexture, mmdMaterial.m_toonTexture}) {
+                if (!path.empty() && !path.starts_with("<embedded-toons>") &&
+                    std::ranges::find(paths, path) == paths.cend())
+                    paths.push_back(path);
+            }
+        }
+        loadImages(paths);
+    }
+    if (config_.textureBudget != 0) {
+        // Load all the images first to see how much they take in total.
+        for (size_t i = 0; i < subMeshCount; ++i) {
+            const auto& mmdMaterial = mmd_.GetMorphs().GetMaterials()[i];
+            for (const auto& path :
+                 {mmdMaterial.m_texture, mmdMaterial.m_spTexture, mmdMaterial.m_toonTexture}) {
+                if (!path.empty())
+                    loadImage(path);
+            }
+        }
+        capTextureSize();
+    }
+    if (config_.textureAtlas) {
+        if (streaming)
+            Info::Log("Texture atlas is disabled since textures are streamed");
+        else
+            packTextureAtlases();
+    }
+    // Streamed textures are compressed by the streamer instead.
+    if (config_.textureCompression && !streaming)
+        compressTextures();
+    // Streamed textures are left empty here and set by streamTextures() later.
+    std::vector<ImageStreamer::Job> jobs;
     for (size_t i = 0; i < subMeshCount; ++i) {
-        const auto& mmdMaterial = model->GetMaterials()[i];
+        const auto& mmdMaterial = mmd_.GetMorphs().GetMaterials()[i];
         Material material(mmdMaterial);
-        if (!mmdMaterial.m_texture.empty()) {
+        if (!mmdMaterial.m_texture.empty() &&
+            !(streaming && queueImage(mmdMaterial.m_texture, jobs))) {
             material.texture = getTexture(mmdMaterial.m_texture);
             if (material.texture) {
-                material.textureHasAlpha = texImages_[mmdMaterial.m_texture].hasAlpha;
+                const auto image = loadImage(mmdMaterial.m_texture);
+                material.textureAlpha = (*image)->second.alphaUsage;
             }
+            if (const auto slot = atlasSlots_.find(resolveImagePath(mmdMaterial.m_texture));
+                slot != atlasSlots_.cend())
+                material.textureTransform = slot->second.transform;
         }
-        if (!mmdMaterial.m_spTexture.empty()) {
+        if (!mmdMaterial.m_spTexture.empty() &&
+            !(streaming && queueImage(mmdMaterial.m_spTexture, jobs))) {
             material.spTexture = getTexture(mmdMaterial.m_spTexture);
+            if (const auto slot = atlasSlots_.find(resolveImagePath(mmdMaterial.m_spTexture));
+                slot != atlasSlots_.cend())
+                material.spTextureTransform = slot->second.transform;
         }
-        if (!mmdMaterial.m_toonTexture.empty()) {
+        if (!mmdMaterial.m_toonTexture.empty() &&
+            !(streaming && queueImage(mmdMaterial.m_toonTexture, jobs))) {
             material.toonTexture = getTexture(mmdMaterial.m_toonTexture);
         }
         materials_.push_back(std::move(material));
     }
+    if (!jobs.empty()) {
+        Info::Log("Decoding", jobs.size(), "textures in background");
+        timeBeginStreaming_ = stm_now();
+        streamingTextures_ = true;
+        imageStreamer_.Start(
+            std::move(jobs), {.generateMipmaps = true, .blockFormats = blockFormats_});
+    } else {
+        reportDeduplication();
+    }
 
     sampler_texture_ = sg_make_sampler(
         sg_sampler_desc{
             .min_filter = SG_FILTER_LINEAR,
             .mag_filter = SG_FILTER_LINEAR,
+            .mipmap_filter = SG_FILTER_LINEAR,
         });
     sampler_sphere_texture_ = sg_make_sampler(
         sg_sampler_desc{
             .min_filter = SG_FILTER_LINEAR,
             .mag_filter = SG_FILTER_LINEAR,
+            .mipmap_filter = SG_FILTER_LINEAR,
         });
+    // Toon textures are lookup tables indexed by lighting, not by the screen
+    // size, so always sample the base level.
     sampler_toon_texture_ = sg_make_sampler(
         sg_sampler_desc{
             .min_filter = SG_FILTER_LINEAR,
             .mag_filter = SG_FILTER_LINEAR,
             .wrap_u = SG_WRAP_CLAMP_TO_EDGE,
             .wrap_v = SG_WRAP_CLAMP_TO_EDGE,
+            .max_lod = 0.0f,
         });
 }
 
 void Routine::initPipeline() {
-    sg_vertex_layout_state layout_desc;
+    // Positions and normals are interleaved as Mesh outputs them.
+    sg_vertex_layout_state layout_desc = {};
+    layout_desc.buffers[vertexBufferIndex].stride = sizeof(Mesh::Vertex);
     layout_desc.attrs[ATTR_mmd_in_Pos] = {
-        .buffer_index = ATTR_mmd_in_Pos,
+        .buffer_index = vertexBufferIndex,
+        .offset = offsetof(Mesh::Vertex, position),
         .format = SG_VERTEXFORMAT_FLOAT3,
     };
     layout_desc.attrs[ATTR_mmd_in_Nor] = {
-        .buffer_index = ATTR_mmd_in_Nor,
+        .buffer_index = vertexBufferIndex,
+        .offset = offsetof(Mesh::Vertex, normal),
         .format = SG_VERTEXFORMAT_FLOAT3,
     };
     layout_desc.attrs[ATTR_mmd_in_UV] = {
-        .buffer_index = ATTR_mmd_in_UV,
+        .buffer_index = uvBufferIndex,
         .format = SG_VERTEXFORMAT_FLOAT2,
     };
 
-    sg_color_target_state color_state = {
+    const sg_color_target_state blendedState = {
         .blend =
             {
                 .enabled = true,
@@ -642,21 +953,27 @@ void Routine::initPipeline() {
                 .compare = SG_COMPAREFUNC_LESS_EQUAL,  // FIXME: SG_COMPAREFUNC_LESS?
                 .write_enabled = true,
             },
-        .colors = {{color_state}},
         .primitive_type = SG_PRIMITIVETYPE_TRIANGLES,
         .index_type = SG_INDEXTYPE_UINT32,
         .cull_mode = SG_CULLMODE_FRONT,
         .face_winding = SG_FACEWINDING_CW,
         .sample_count = Context::getSampleCount(),
     };
+    pipeline_desc.layout.buffers[vertexBufferIndex] = layout_desc.buffers[vertexBufferIndex];
     pipeline_desc.layout.attrs[ATTR_mmd_in_Pos] = layout_desc.attrs[ATTR_mmd_in_Pos];
     pipeline_desc.layout.attrs[ATTR_mmd_in_Nor] = layout_desc.attrs[ATTR_mmd_in_Nor];
     pipeline_desc.layout.attrs[ATTR_mmd_in_UV] = layout_desc.attrs[ATTR_mmd_in_UV];
 
-    pipeline_frontface_ = sg_make_pipeline(&pipeline_desc);
-
-    pipeline_desc.cull_mode = SG_CULLMODE_NONE;
-    pipeline_bothface_ = sg_make_pipeline(&pipeline_desc);
+    // Opaque and cutout materials write opaque pixels only, so they don't
+    // need blending.
+    for (size_t usage = 0; usage < pipelines_.size(); ++usage) {
+        const bool blended = usage == Enum::underlyCast(AlphaUsage::Blended);
+        pipeline_desc.colors[0] = blended ? blendedState : sg_color_target_state{};
+        pipeline_desc.cull_mode = SG_CULLMODE_FRONT;
+        pipelines_[usage][0] = sg_make_pipeline(&pipeline_desc);
+        pipeline_desc.cull_mode = SG_CULLMODE_NONE;
+        pipelines_[usage][1] = sg_make_pipeline(&pipeline_desc);
+    }
 }
 
 void Routine::selectNextMotion() {
@@ -679,7 +996,46 @@ void Routine::selectNextMotion() {
         Err::Exit("Internal error: unreachable:", __FILE__ ":", __LINE__, ':', __func__);
 }
 
+// Start the current motion from its first frame with the settled physics
+// state, instead of bridging from the previous pose.
+void Routine::warmStartMotion() {
+    const auto& animations = mmd_.GetAnimations();
+    if (!animations.empty()) {
+        // Settling a motion for the first time resets the pose.
+        const auto& snapshot = getPhysicsSnapshot(motionID_);
+        const auto model = mmd_.GetModel();
+        mmd_.GetSkeleton().BeginAnimation(*model, mmd_.GetMorphs().IsEnabled());
+        animations[motionID_].first->Evaluate(0.0f);
+        mmd_.GetMorphs().Update(*model);
+        mmd_.GetSkeleton().UpdateBeforePhysics(*model);
+        snapshot.Restore(*model);
+        mmd_.GetSkeleton().UpdateAfterPhysics();
+        model->EndAnimation();
+    }
+    needBridgeMotions_ = false;
+    timeBeginAnimation_ = timeLastFrame_ = stm_now();
+}
+
 void Routine::Update() {
+    // Bookkeeping for the previous frame, out of the tracked scope.
+    Allocator::EndFrame();
+    AllocationTracker::EndFrame();
+    ++statsFrames_;
+    if (config_.statsInterval > 0.0f &&
+        stm_sec(stm_since(timeLastStats_)) >= config_.statsInterval)
+        reportStats();
+    // Uploading textures allocates, which is fine as it ends in a few frames.
+    streamTextures();
+
+    // Stepping physics over a long stall, e.g. after the system sleeps, makes
+    // a large CPU spike and hardly ends up in a sane state.  Start the current
+    // motion over from its settled state instead, which may settle it first.
+    if (!mmd_.GetAnimations().empty() &&
+        stm_sec(stm_since(timeLastFrame_)) > Constant::PhysicsStallThreshold)
+        warmStartMotion();
+
+    const AllocationTracker::Scope allocScope("Routine::Update");
+
     const auto size{Context::getWindowSize()};
     const auto model = mmd_.GetModel();
     const size_t vertCount = model->GetVertexCount();
@@ -687,7 +1043,9 @@ void Routine::Update() {
     auto& animations = mmd_.GetAnimations();
 
     if (!animations.empty()) {
-        const double elapsedTime = stm_sec(stm_since(timeLastFrame_));
+        // Physics never steps over more than the threshold in a frame.
+        const double elapsedTime =
+            std::min(stm_sec(stm_since(timeLastFrame_)), Constant::PhysicsStallThreshold);
         const double vmdFrame = stm_sec(stm_since(timeBeginAnimation_)) * Constant::VmdFPS;
 
         // Update camera animation.
@@ -711,39 +1069,74 @@ void Routine::Update() {
 
         viewMatrix_ = userView_.GetWorldViewMatrix() * viewMatrix_;
 
-        model->BeginAnimation();
+        if (config_.physicsLOD) {
+            const auto wvp = userView_.GetViewportMatrix() * projectionMatrix_ * viewMatrix_;
+            // Bounds of the last frame are close enough to select the level.
+            const auto& mesh = mmd_.GetMesh();
+            physicsLOD_.Update(
+                *model, wvp, Context::getDrawableSize(), mesh.GetBoundsMin(),
+                mesh.GetBoundsMax());
+        }
+
+        uint64_t lapTime = stm_now();
+        const auto endPhase = [this, &lapTime](UpdatePhase phase) {
+            phaseTimes_[Enum::underlyCast(phase)] += stm_laptime(&lapTime);
+        };
+
+        auto& mesh = mmd_.GetMesh();
+        std::optional<Mesh::FrameKey> frameKey;
+        mmd_.GetSkeleton().BeginAnimation(*model, mmd_.GetMorphs().IsEnabled());
         if (needBridgeMotions_) {
             vmdAnim->Evaluate(0.0f, stm_sec(stm_since(timeBeginAnimation_)));
-            model->UpdateMorphAnimation();
-            model->UpdateNodeAnimation(false);
-            model->UpdatePhysicsAnimation(elapsedTime);
-            model->UpdateNodeAnimation(true);
             if (vmdFrame >= Constant::VmdFPS) {
                 needBridgeMotions_ = false;
                 timeBeginAnimation_ = stm_now();
             }
+        } else if (mesh.IsCacheEnabled()) {
+            // Sample the motion on a fixed grid so that later loops of it land
+            // on the cached frames.
+            constexpr double step = Constant::VertexCacheFPS / Constant::VmdFPS;
+            const double frame = std::floor(vmdFrame * step);
+            vmdAnim->Evaluate(frame / step);
+            frameKey = {.motion = motionID_, .frame = static_cast<uint32_t>(frame)};
         } else {
-            model->UpdateAllAnimation(vmdAnim.get(), vmdFrame, elapsedTime);
+            vmdAnim->Evaluate(vmdFrame);
         }
+        endPhase(UpdatePhase::Evaluate);
+        mmd_.GetMorphs().Update(*model);
+        endPhase(UpdatePhase::Morph);
+        mmd_.GetSkeleton().UpdateBeforePhysics(*model);
+        endPhase(UpdatePhase::NodeBeforePhysics);
+        physicsLOD_.UpdatePhysicsAnimation(*model, elapsedTime);
+        endPhase(UpdatePhase::Physics);
+        mmd_.GetSkeleton().UpdateAfterPhysics();
         model->EndAnimation();
-
-        model->Update();
-
-        sg_update_buffer(
-            posVB_, sg_range{
-                        .ptr = model->GetUpdatePositions(),
-                        .size = vertCount * sizeof(glm::vec3),
-                    });
-        sg_update_buffer(
-            normVB_, sg_range{
-                         .ptr = model->GetUpdateNormals(),
-                         .size = vertCount * sizeof(glm::vec3),
-                     });
-        sg_update_buffer(
-            uvVB_, sg_range{
-                       .ptr = model->GetUpdateUVs(),
-                       .size = vertCount * sizeof(glm::vec2),
-                   });
+        endPhase(UpdatePhase::NodeAfterPhysics);
+
+        mesh.Update(*model, mmd_.GetMorphs(), frameKey);
+        endPhase(UpdatePhase::Skinning);
+
+        // Vertices after the upload count are used only by hidden materials,
+        // which aren't drawn, so leaving them stale is harmless.
+        const size_t uploadCount = mesh.GetUploadVertexCount();
+        if (uploadCount != 0) {
+            sg_update_buffer(
+                vertexVB_, sg_range{
+                               .ptr = mesh.GetVertices(),
+                               .size = uploadCount * sizeof(Mesh::Vertex),
+                           });
+        }
+        // Keeping the buffer as is when nothing changed is safe, while a
+        // partial update is not, since sokol may rotate the buffer between
+        // frames in flight.
+        if (mesh.IsUVChanged()) {
+            sg_update_buffer(
+                uvVB_, sg_range{
+                           .ptr = mesh.GetUVs(),
+                           .size = vertCount * sizeof(glm::vec2),
+                       });
+        }
+        endPhase(UpdatePhase::Upload);
 
         timeLastFrame_ = stm_now();
         if (vmdFrame > vmdAnim->GetMaxKeyTime()) {
@@ -759,16 +1152,12 @@ void Routine::Update() {
         projectionMatrix_ = glm::perspectiveFovRH(
             glm::radians(30.0f), static_cast<float>(size.x), static_cast<float>(size.y), 1.0f,
             10000.0f);
+        // The mesh holds the rest pose until it is animated.
         sg_update_buffer(
-            posVB_, sg_range{
-                        .ptr = model->GetPositions(),
-                        .size = vertCount * sizeof(glm::vec3),
-                    });
-        sg_update_buffer(
-            normVB_, sg_range{
-                         .ptr = model->GetNormals(),
-                         .size = vertCount * sizeof(glm::vec3),
-                     });
+            vertexVB_, sg_range{
+                           .ptr = mmd_.GetMesh().GetVertices(),
+                           .size = vertCount * sizeof(Mesh::Vertex),
+                       });
         sg_update_buffer(
             uvVB_, sg_range{
                        .ptr = model->GetUVs(),
@@ -778,6 +1167,7 @@ void Routine::Update() {
 }
 
 void Routine::Draw() {
+    const AllocationTracker::Scope allocScope("Routine::Draw");
     const auto model = mmd_.GetModel();
 
     const auto userView = userView_.GetViewportMatrix();
@@ -794,90 +1184,108 @@ void Routine::Draw() {
     };
     sg_begin_pass(&pass);
 
+    // Opaque materials are drawn first to cover pixels behind them before
+    // they are shaded, and blended ones last.  Materials of the same usage are
+    // drawn in the order of the model.
     const size_t subMeshCount = model->GetSubMeshCount();
-    for (size_t i = 0; i < subMeshCount; ++i) {
-        const auto& subMesh = model->GetSubMeshes()[i];
-        const auto& material = materials_[subMesh.m_materialID];
-        const auto& mmdMaterial = material.material;
-
-        if (mmdMaterial.m_alpha == 0)
-            continue;
+    sg_pipeline lastPipeline = {};
+    sg_bindings lastBinds = {};
+    for (const auto usage : {AlphaUsage::Opaque, AlphaUsage::Cutout, AlphaUsage::Blended}) {
+        for (size_t i = 0; i < subMeshCount; ++i) {
+            const auto& subMesh = model->GetSubMeshes()[i];
+            const auto& material = materials_[subMesh.m_materialID];
+            const auto& mmdMaterial = material.material;
+
+            if (mmdMaterial.m_alpha == 0 || material.GetAlphaUsage() != usage)
+                continue;
+
+            const u_mmd_vs_t u_mmd_vs = {
+                .u_WV = wv,
+                .u_WVP = wvp,
+            };
+
+            u_mmd_fs_t u_mmd_fs = {
+                .u_Alpha = mmdMaterial.m_alpha,
+                .u_Diffuse = mmdMaterial.m_diffuse,
+                .u_Ambient = mmdMaterial.m_ambient,
+                .u_Specular = mmdMaterial.m_specular,
+                .u_SpecularPower = mmdMaterial.m_specularPower,
+                .u_LightColor = lightColor,
+                .u_LightDir = lightDir,
+                .u_TexMode = 0,
+                .u_ToonTexMode = 0,
+                .u_SphereTexMode = 0,
+                .u_AlphaCutoff = usage == AlphaUsage::Cutout ? Constant::AlphaCutoff : 0.0f,
+                .u_TexTransform = material.textureTransform,
+                .u_SphereTexTransform = material.spTextureTransform,
+            };
 
-        const u_mmd_vs_t u_mmd_vs = {
-            .u_WV = wv,
-            .u_WVP = wvp,
-        };
+            if (material.texture) {
+                binds_.views[VIEW_u_Tex] = material.texture->getView();
+                binds_.samplers[SMP_u_Tex_smp] = sampler_texture_;
+                if (material.textureAlpha != AlphaUsage::Opaque) {
+                    // Use Material Alpha * Texture Alpha
+                    u_mmd_fs.u_TexMode = 2;
+                } else {
+                    // Use Material Alpha
+                    u_mmd_fs.u_TexMode = 1;
+                }
+                u_mmd_fs.u_TexMulFactor = mmdMaterial.m_textureMulFactor;
+                u_mmd_fs.u_TexAddFactor = mmdMaterial.m_textureAddFactor;
+            } else {
+                binds_.views[VIEW_u_Tex] = dummyTex_.getView();
+                binds_.samplers[SMP_u_Tex_smp] = sampler_texture_;
+            }
 
-        u_mmd_fs_t u_mmd_fs = {
-            .u_Alpha = mmdMaterial.m_alpha,
-            .u_Diffuse = mmdMaterial.m_diffuse,
-            .u_Ambient = mmdMaterial.m_ambient,
-            .u_Specular = mmdMaterial.m_specular,
-            .u_SpecularPower = mmdMaterial.m_specularPower,
-            .u_LightColor = lightColor,
-            .u_LightDir = lightDir,
-            .u_TexMode = 0,
-            .u_ToonTexMode = 0,
-            .u_SphereTexMode = 0,
-        };
+            if (material.spTexture) {
+                binds_.views[VIEW_u_SphereTex] = material.spTexture->getView();
+                binds_.samplers[SMP_u_SphereTex_smp] = sampler_sphere_texture_;
+                switch (mmdMaterial.m_spTextureMode) {
+                case saba::MMDMaterial::SphereTextureMode::Mul:
+                    u_mmd_fs.u_SphereTexMode = 1;
+                    break;
+                case saba::MMDMaterial::SphereTextureMode::Add:
+                    u_mmd_fs.u_SphereTexMode = 2;
+                    break;
+                default:
+                    break;
+                }
+                u_mmd_fs.u_SphereTexMulFactor = mmdMaterial.m_spTextureMulFactor;
+                u_mmd_fs.u_SphereTexAddFactor = mmdMaterial.m_spTextureAddFactor;
+            } else {
+                binds_.views[VIEW_u_SphereTex] = dummyTex_.getView();
+                binds_.samplers[SMP_u_SphereTex_smp] = sampler_sphere_texture_;
+            }
 
-        if (material.texture) {
-            binds_.views[VIEW_u_Tex] = material.texture->getView();
-            binds_.samplers[SMP_u_Tex_smp] = sampler_texture_;
-            if (material.textureHasAlpha) {
-                // Use Material Alpha * Texture Alpha
-                u_mmd_fs.u_TexMode = 2;
+            if (material.toonTexture) {
+                binds_.views[VIEW_u_ToonTex] = material.toonTexture->getView();
+                binds_.samplers[SMP_u_ToonTex_smp] = sampler_toon_texture_;
+                u_mmd_fs.u_ToonTexMulFactor = mmdMaterial.m_toonTextureMulFactor;
+                u_mmd_fs.u_ToonTexAddFactor = mmdMaterial.m_toonTextureAddFactor;
+                u_mmd_fs.u_ToonTexMode = 1;
             } else {
-                // Use Material Alpha
-                u_mmd_fs.u_TexMode = 1;
+                binds_.views[VIEW_u_ToonTex] = dummyTex_.getView();
+                binds_.samplers[SMP_u_ToonTex_smp] = sampler_toon_texture_;
             }
-            u_mmd_fs.u_TexMulFactor = mmdMaterial.m_textureMulFactor;
-            u_mmd_fs.u_TexAddFactor = mmdMaterial.m_textureAddFactor;
-        } else {
-            binds_.views[VIEW_u_Tex] = dummyTex_.getView();
-            binds_.samplers[SMP_u_Tex_smp] = sampler_texture_;
-        }
 
-        if (material.spTexture) {
-            binds_.views[VIEW_u_SphereTex] = material.spTexture->getView();
-            binds_.samplers[SMP_u_SphereTex_smp] = sampler_sphere_texture_;
-            switch (mmdMaterial.m_spTextureMode) {
-            case saba::MMDMaterial::SphereTextureMode::Mul:
-                u_mmd_fs.u_SphereTexMode = 1;
-                break;
-            case saba::MMDMaterial::SphereTextureMode::Add:
-                u_mmd_fs.u_SphereTexMode = 2;
-                break;
-            default:
-                break;
+            // Materials sharing an atlas often come in a row, which need not
+            // apply the same pipeline and bindings again.  Bindings must be
+            // applied again after a pipeline is applied.
+            const auto pipeline = pipelines_[Enum::underlyCast(usage)][mmdMaterial.m_bothFace];
+            const bool pipelineChanged = pipeline.id != lastPipeline.id;
+            if (pipelineChanged) {
+                sg_apply_pipeline(pipeline);
+                lastPipeline = pipeline;
             }
-            u_mmd_fs.u_SphereTexMulFactor = mmdMaterial.m_spTextureMulFactor;
-            u_mmd_fs.u_SphereTexAddFactor = mmdMaterial.m_spTextureAddFactor;
-        } else {
-            binds_.views[VIEW_u_SphereTex] = dummyTex_.getView();
-            binds_.samplers[SMP_u_SphereTex_smp] = sampler_sphere_texture_;
-        }
+            if (pipelineChanged || !isSameViews(binds_, lastBinds)) {
+                sg_apply_bindings(binds_);
+                lastBinds = binds_;
+            }
+            sg_apply_uniforms(UB_u_mmd_vs, SG_RANGE(u_mmd_vs));
+            sg_apply_uniforms(UB_u_mmd_fs, SG_RANGE(u_mmd_fs));
 
-        if (material.toonTexture) {
-            binds_.views[VIEW_u_ToonTex] = material.toonTexture->getView();
-            binds_.samplers[SMP_u_ToonTex_smp] = sampler_toon_texture_;
-            u_mmd_fs.u_ToonTexMulFactor = mmdMaterial.m_toonTextureMulFactor;
-            u_mmd_fs.u_ToonTexAddFactor = mmdMaterial.m_toonTextureAddFactor;
-            u_mmd_fs.u_ToonTexMode = 1;
-        } else {
-            binds_.views[VIEW_u_ToonTex] = dummyTex_.getView();
-            binds_.samplers[SMP_u_ToonTex_smp] = sampler_toon_texture_;
+            sg_draw(subMesh.m_beginIndex, subMesh.m_vertexCount, 1);
         }
-
-        if (mmdMaterial.m_bothFace)
-            sg_apply_pipeline(pipeline_bothface_);
-        else
-            sg_apply_pipeline(pipeline_frontface_);
-        sg_apply_bindings(binds_);
-        sg_apply_uniforms(UB_u_mmd_vs, SG_RANGE(u_mmd_vs));
-        sg_apply_uniforms(UB_u_mmd_fs, SG_RANGE(u_mmd_fs));
-
-        sg_draw(subMesh.m_beginIndex, subMesh.m_vertexCount, 1);
     }
 
     if (Context::shouldEmphasizeModel()) {
@@ -893,27 +1301,41 @@ void Routine::Terminate() {
     if (!shouldTerminate_)
         return;
 
-    for (auto& texture : textures_) {
-        texture.second.destroy();
+    imageStreamer_.Stop();
+    for (auto& [_, placeholder] : placeholders_)
+        placeholder.destroy();
+
+    // Paths of the same content share a texture, which is destroyed only once.
+    for (auto& [path, texture] : textures_) {
+        if (!imageAliases_.contains(path))
+            texture.destroy();
     }
 
     motionID_ = 0;
     motionWeights_.clear();
     induces_.clear();
     texImages_.clear();
+    imageAliases_.clear();
+    imagePathByHash_.clear();
     textures_.clear();
+    atlasSlots_.clear();
+    streamingTextures_ = false;
+    decodedImages_.clear();
+    pendingUploads_.clear();
+    placeholders_.clear();
     materials_.clear();
 
     sg_destroy_shader(shaderMMD_);
 
-    sg_destroy_buffer(posVB_);
-    sg_destroy_buffer(normVB_);
+    sg_destroy_buffer(vertexVB_);
     sg_destroy_buffer(uvVB_);
 
     dummyTex_.destroy();
 
-    sg_destroy_pipeline(pipeline_frontface_);
-    sg_destroy_pipeline(pipeline_bothface_);
+    for (const auto& pipelines : pipelines_) {
+        for (const auto pipeline : pipelines)
+            sg_destroy_pipeline(pipeline);
+    }
 
     sg_shutdown();
 
@@ -975,18 +1397,66 @@ const Config& Routine::GetConfig() const {
     return config_;
 }
 
+void Routine::loadImages(const std::vector<std::string>& paths) {
+    const bool reportSpeed = config_.statsInterval > 0.0f;
+    auto decoded = Image::decodeFiles(paths, {.generateMipmaps = true}, reportSpeed);
+    for (auto& result : decoded) {
+        if (result.sameAs) {
+            // Left to loadImage() when the first file failed.
+            const auto& first = decoded[*result.sameAs].path;
+            if (const auto image = texImages_.find(first); image != texImages_.cend()) {
+                imageAliases_.emplace(result.path, first);
+                dedupedBytes_ += getImageBytes(image->second);
+                Info::Log("Texture", result.path, "has the same content as", first);
+            }
+            continue;
+        }
+        if (!result.image) {
+            Err::Log(result.error);
+            continue;
+        }
+        if (reportSpeed)
+            reportDecoderSpeed(result.path, result.data);
+        imagePathByHash_.emplace(result.contentHash, result.path);
+        texImages_.emplace(result.path, std::move(*result.image));
+    }
+}
+
 std::optional<Routine::ImageMap::const_iterator> Routine::loadImage(const std::string& path) {
+    if (const auto alias = imageAliases_.find(path); alias != imageAliases_.cend())
+        return texImages_.find(alias->second);
+
     const auto itr = texImages_.find(path);
     if (itr == texImages_.cend()) {
         Image img;
         if (path.starts_with("<embedded-toons>")) {
-            if (img.loadFromMemory(Resource::getToonData(path))) {
+            // Toons are sampled only at the base level, so no mipmaps needed.
+            if (const auto toon = Resource::findToon(path)) {
+                img.loadFromToon(*toon);
                 texImages_.emplace(path, std::move(img));
                 return texImages_.find(path);
             }
-        } else if (img.loadFromFile(path)) {
-            texImages_.emplace(path, std::move(img));
-            return texImages_.find(path);
+            Err::Log("Internal error: Unknown toon image:", path);
+        } else if (std::vector<uint8_t> data; Image::readFile(path, data)) {
+            // Files of the same content share the image decoded first, whatever
+            // their paths are.
+            const uint64_t hash = Image::hashContent(data);
+            if (const auto same = findSameContent(imagePathByHash_, hash, data)) {
+                const auto image = texImages_.find(*same);
+                imageAliases_.emplace(path, *same);
+                dedupedBytes_ += getImageBytes(image->second);
+                Info::Log("Texture", path, "has the same content as", *same);
+                return image;
+            }
+            if (img.loadFromMemory({data.data(), data.size()})) {
+                if (config_.statsInterval > 0.0f)
+                    reportDecoderSpeed(path, data);
+                img.generateMipmaps();
+                texImages_.emplace(path, std::move(img));
+                imagePathByHash_.emplace(hash, path);
+                return texImages_.find(path);
+            }
+            Err::Log("Failed to decode image:", path);
         }
         return std::nullopt;
     } else {
@@ -997,30 +1467,461 @@ std::optional<Routine::ImageMap::const_iterator> Routine::loadImage(const std::s
 std::optional<SgImageView> Routine::getTexture(const std::string& path) {
     if (const auto itr = textures_.find(path); itr != textures_.cend())
         return itr->second;
+    if (const auto slot = atlasSlots_.find(resolveImagePath(path)); slot != atlasSlots_.cend())
+        return getTexture(slot->second.atlas);
 
     const auto itr = loadImage(path);
     if (!itr)
         return std::nullopt;
+    if (const auto shared = textures_.find((*itr)->first); shared != textures_.cend()) {
+        textures_.emplace(path, shared->second);
+        return shared->second;
+    }
 
     const auto& image = (*itr)->second;
+    const int mipmapCount = std::min<int>(image.mipmaps.size() + 1, SG_MAX_MIPMAPS);
     sg_image_desc image_desc = {
         .type = SG_IMAGETYPE_2D,
         .width = static_cast<int>(image.width),
         .height = static_cast<int>(image.height),
+        .num_mipmaps = mipmapCount,
         .pixel_format = SG_PIXELFORMAT_RGBA8,
     };
     image_desc.data.mip_levels[0] = {
         .ptr = image.pixels.data(),
         .size = image.pixels.size(),
     };
+    for (int level = 1; level < mipmapCount; ++level) {
+        const auto& mipmap = image.mipmaps[level - 1];
+        image_desc.data.mip_levels[level] = {.ptr = mipmap.data(), .size = mipmap.size()};
+    }
+
+    if (const auto format = image.blockFormat) {
+        for (int level = 0; level < mipmapCount; ++level) {
+            const auto& blocks = image.blocks[level];
+            image_desc.data.mip_levels[level] = {.ptr = blocks.data(), .size = blocks.size()};
+        }
+        image_desc.pixel_format = toPixelFormat(*format);
+        if (config_.statsInterval > 0.0f) {
+            Info::Log(
+                "[stats] Compressed texture", path, "into", BCn::GetName(*format),
+                "with PSNR", image.blockPSNR, "dB");
+        }
+    }
     const auto handler = SgImageView(image_desc);
-    textures_.emplace(path, handler);
+    textures_.emplace((*itr)->first, handler);
+    if ((*itr)->first != path)
+        textures_.emplace(path, handler);
     return handler;
 }
 
+bool Routine::queueImage(const std::string& path, std::vector<ImageStreamer::Job>& jobs) {
+    if (path.starts_with("<embedded-toons>") || texImages_.contains(path))
+        return false;
+    if (const auto alias = imageAliases_.find(path); alias != imageAliases_.cend())
+        return !texImages_.contains(alias->second);
+    if (std::ranges::any_of(jobs, [&path](const auto& job) { return job.path == path; }))
+        return true;
+
+    // Files are read and hashed here so that files of the same content are
+    // decoded only once.  When reading fails, the material goes without the
+    // texture as when it's loaded at once.
+    std::vector<uint8_t> data;
+    if (!Image::readFile(path, data))
+        return true;
+    const uint64_t hash = Image::hashContent(data);
+    if (const auto same = findSameContent(imagePathByHash_, hash, data)) {
+        imageAliases_.emplace(path, *same);
+        Info::Log("Texture", path, "has the same content as", *same);
+        return !texImages_.contains(*same);
+    }
+    imagePathByHash_.emplace(hash, path);
+    jobs.push_back({.path = path, .data = std::move(data)});
+    return true;
+}
+
+void Routine::streamTextures() {
+    if (!streamingTextures_)
+        return;
+
+    const bool decoding = imageStreamer_.Poll(decodedImages_);
+    for (auto& decoded : decodedImages_) {
+        if (!decoded.image) {
+            Err::Log(decoded.error);
+            continue;
+        }
+        const auto isAlias = [&decoded](const auto& alias) {
+            return alias.second == decoded.path;
+        };
+        dedupedBytes_ +=
+            getImageBytes(*decoded.image) * std::ranges::count_if(imageAliases_, isAlias);
+        texImages_.emplace(decoded.path, std::move(*decoded.image));
+        pendingUploads_.push_back(decoded.path);
+    }
+    decodedImages_.clear();
+
+    // At least one texture is uploaded per frame so that large ones aren't left
+    // behind forever.
+    size_t uploadedBytes = 0;
+    while (!pendingUploads_.empty()) {
+        const std::string path = pendingUploads_.front();
+        const auto& image = texImages_.at(path);
+        const size_t bytes = getImageBytes(image);
+        if (uploadedBytes != 0 && uploadedBytes + bytes > Constant::TextureUploadBytesPerFrame)
+            break;
+        uploadedBytes += bytes;
+        pendingUploads_.pop_front();
+        if (const auto texture = getTexture(path))
+            setStreamedTexture(path, *texture, image.alphaUsage);
+        if (auto placeholder = placeholders_.find(path); placeholder != placeholders_.end()) {
+            placeholder->second.destroy();
+            placeholders_.erase(placeholder);
+        }
+    }
+
+    // The rest are shown in their average color, i.e. the 1x1 mip level, until
+    // they are uploaded.
+    for (const auto& path : pendingUploads_) {
+        if (placeholders_.contains(path))
+            continue;
+        const auto& image = texImages_.at(path);
+        const auto& average = image.mipmaps.empty() ? image.pixels : image.mipmaps.back();
+        const auto placeholder = SgImageView(
+            sg_image_desc{
+                .width = 1,
+                .height = 1,
+                .data =
+                    {
+                        .mip_levels = {{.ptr = average.data(), .size = 4}},
+                    },
+            });
+        placeholders_.emplace(path, placeholder);
+        setStreamedTexture(path, placeholder, image.alphaUsage);
+    }
+
+    if (!decoding && pendingUploads_.empty()) {
+        streamingTextures_ = false;
+        Info::Log(
+            "Textures are streamed in", stm_sec(stm_since(timeBeginStreaming_)), "seconds");
+        reportDeduplication();
+    }
+}
+
+void Routine::setStreamedTexture(
+    const std::string& path, const SgImageView& texture, AlphaUsage alphaUsage) {
+    for (auto& material : materials_) {
+        const auto& mmdMaterial = material.material;
+        if (resolveImagePath(mmdMaterial.m_texture) == path) {
+            material.texture = texture;
+            material.textureAlpha = alphaUsage;
+        }
+        if (resolveImagePath(mmdMaterial.m_spTexture) == path)
+            material.spTexture = texture;
+        if (resolveImagePath(mmdMaterial.m_toonTexture) == path)
+            material.toonTexture = texture;
+    }
+}
+
+const std::string& Routine::resolveImagePath(const std::string& path) const {
+    const auto alias = imageAliases_.find(path);
+    return alias == imageAliases_.cend() ? path : alias->second;
+}
+
+void Routine::reportDeduplication() {
+    if (!imageAliases_.empty()) {
+        Info::Log(
+            "Deduplicated", imageAliases_.size(), "textures by content, saving", dedupedBytes_,
+            "bytes");
+    }
+}
+
+void Routine::capTextureSize() {
+    // Texels finer than the window are not seen unless the model is zoomed in.
+    // Start from the window size and halve it until the textures fit the budget.
+    const glm::vec2 drawableSize = Context::getDrawableSize();
+    const auto longSide = static_cast<unsigned int>(std::max(drawableSize.x, drawableSize.y));
+    int maxSize = static_cast<int>(std::bit_ceil(std::max(longSide, 1u)));
+
+    // The largest mip level whose longer side fits in "maxSize".
+    const auto getLevel = [](const Image& image, int maxSize) {
+        size_t level = 0;
+        while (level < image.mipmaps.size() &&
+               std::max(image.width >> level, image.height >> level) > maxSize)
+            ++level;
+        return level;
+    };
+    // Textures are compressed after they are capped, so count the size of
+    // their blocks if the capped size will be compressed.
+    const auto getTotalBytes = [this, &getLevel](int maxSize) {
+        size_t bytes = 0;
+        for (const auto& [_, image] : texImages_) {
+            const size_t level = getLevel(image, maxSize);
+            const int width = std::max(image.width >> level, 1);
+            const int height = std::max(image.height >> level, 1);
+            const auto format =
+                Image::selectBlockFormat(blockFormats_, image.alphaUsage, width, height);
+            for (size_t l = level; l <= image.mipmaps.size(); ++l) {
+                if (format) {
+                    bytes += BCn::GetEncodedSize(
+                        *format, std::max(image.width >> l, 1),
+                        std::max(image.height >> l, 1));
+                } else {
+                    bytes += l == 0 ? image.pixels.size() : image.mipmaps[l - 1].size();
+                }
+            }
+        }
+        return bytes;
+    };
+
+    const size_t bytesBefore = getTotalBytes(std::numeric_limits<int>::max());
+    while (maxSize > Constant::MinTextureSize &&
+           getTotalBytes(maxSize) > config_.textureBudget)
+        maxSize /= 2;
+
+    for (auto& [path, image] : texImages_) {
+        const size_t level = getLevel(image, maxSize);
+        if (level == 0)
+            continue;
+        const int width = image.width;
+        const int height = image.height;
+        image.shrinkToLevel(level);
+        Info::Log(
+            "Downscaled texture", path, "from", width, 'x', height, "to", image.width, 'x',
+            image.height);
+    }
+    Info::Log(
+        "Textures are capped at", maxSize, "pixels and take", getTotalBytes(maxSize),
+        "bytes out of", bytesBefore, "bytes");
+}
+
+void Routine::packTextureAtlases() {
+    const auto model = mmd_.GetModel();
+    const size_t subMeshCount = model->GetSubMeshCount();
+    const auto& mmdMaterials = mmd_.GetMorphs().GetMaterials();
+
+    // Atlases can't repeat textures, so textures of materials whose UVs may go
+    // out of the unit square are not packed.
+    std::vector<bool> uvMorphed(model->GetVertexCount());
+    for (const auto vertex : mmd_.GetMorphs().GetUVMorphVertices())
+        uvMorphed[vertex] = true;
+    const glm::vec2 *uvs = model->GetUVs();
+    std::vector<bool> repeats(subMeshCount);
+    for (size_t i = 0; i < subMeshCount; ++i) {
+        const auto& subMesh = model->GetSubMeshes()[i];
+        const auto begin = induces_.cbegin() + subMesh.m_beginIndex;
+        const bool outside =
+            std::any_of(begin, begin + subMesh.m_vertexCount, [&](uint32_t vertex) {
+                const auto uv = uvs[vertex];
+                return uvMorphed[vertex] || uv.x < 0.0f || uv.x > 1.0f || uv.y < 0.0f ||
+                       uv.y > 1.0f;
+            });
+        if (outside && static_cast<size_t>(subMesh.m_materialID) < subMeshCount)
+            repeats[subMesh.m_materialID] = true;
+    }
+
+    // Toon textures are sampled with clamping at the base level of their own.
+    std::vector<std::string> excluded;
+    for (size_t i = 0; i < subMeshCount; ++i) {
+        const auto& mmdMaterial = mmdMaterials[i];
+        if (repeats[i] && !mmdMaterial.m_texture.empty())
+            excluded.push_back(resolveImagePath(mmdMaterial.m_texture));
+        if (!mmdMaterial.m_toonTexture.empty())
+            excluded.push_back(resolveImagePath(mmdMaterial.m_toonTexture));
+    }
+
+    // Mip levels of a texture are copied into the atlas while the padding is
+    // at least a pixel, which needs the texture to be a multiple of it.
+    const size_t atlasMipmaps =
+        std::countr_zero(static_cast<unsigned int>(Constant::AtlasPadding));
+    std::vector<std::string> paths;
+    std::vector<const Image *> images;
+    int maxSize = 0;
+    for (size_t i = 0; i < subMeshCount; ++i) {
+        const auto& mmdMaterial = mmdMaterials[i];
+        for (const auto& candidate : {mmdMaterial.m_texture, mmdMaterial.m_spTexture}) {
+            const auto& path = resolveImagePath(candidate);
+            if (path.empty() || std::ranges::find(excluded, path) != excluded.cend() ||
+                std::ranges::find(paths, path) != paths.cend())
+                continue;
+            const auto image = texImages_.find(path);
+            if (image == texImages_.cend())
+                continue;
+            const auto& [_, img] = *image;
+            if (img.width > Constant::AtlasMaxTextureSize ||
+                img.height > Constant::AtlasMaxTextureSize ||
+                img.width % Constant::AtlasPadding != 0 ||
+                img.height % Constant::AtlasPadding != 0 || img.mipmaps.size() < atlasMipmaps)
+                continue;
+            paths.push_back(path);
+            images.push_back(&img);
+            maxSize = std::max({maxSize, img.width, img.height});
+        }
+    }
+    if (images.size() < 2)
+        return;
+
+    // The smallest atlas holding all the textures, or as many atlases of the
+    // largest size as needed.
+    auto atlasSize = static_cast<int>(
+        std::bit_ceil(static_cast<unsigned int>(maxSize + Constant::AtlasPadding * 2)));
+    size_t atlasCount = 0;
+    std::vector<Atlas::Placement> placements;
+    for (;; atlasSize *= 2) {
+        placements = Atlas::Pack(images, atlasSize, Constant::AtlasPadding, atlasCount);
+        if (atlasCount == 1 || atlasSize >= Constant::AtlasSize)
+            break;
+    }
+
+    size_t packedCount = 0;
+    size_t builtCount = 0;
+    for (size_t index = 0; index < atlasCount; ++index) {
+        // An atlas of a single texture saves nothing.
+        if (std::ranges::count(placements, index, &Atlas::Placement::atlas) < 2)
+            continue;
+        const std::string atlasPath = "<atlas>" + std::to_string(index);
+        texImages_.emplace(
+            atlasPath,
+            Atlas::Build(images, placements, index, atlasSize, Constant::AtlasPadding));
+        for (size_t i = 0; i < images.size(); ++i) {
+            const auto& placement = placements[i];
+            if (placement.atlas != index)
+                continue;
+            const float size = static_cast<float>(atlasSize);
+            atlasSlots_.emplace(
+                paths[i], AtlasSlot{
+                              .atlas = atlasPath,
+                              .transform = glm::vec4(
+                                  images[i]->width / size, images[i]->height / size,
+                                  placement.x / size, placement.y / size),
+                          });
+            ++packedCount;
+        }
+        ++builtCount;
+    }
+    Info::Log(
+        "Packed", packedCount, "textures into", builtCount, "atlases of", atlasSize, 'x',
+        atlasSize, "pixels");
+}
+
+void Routine::compressTextures() {
+    // Toons are loaded on demand otherwise.
+    for (size_t i = 0; i < mmd_.GetModel()->GetSubMeshCount(); ++i) {
+        if (const auto& path = mmd_.GetMorphs().GetMaterials()[i].m_toonTexture; !path.empty())
+            loadImage(path);
+    }
+
+    // Textures packed into atlases are not uploaded by themselves.
+    std::vector<Image *> images;
+    for (auto& [path, image] : texImages_) {
+        if (!atlasSlots_.contains(path))
+            images.push_back(&image);
+    }
+    const uint64_t timeBegin = stm_now();
+    Image::encodeBlocks(images, blockFormats_);
+    const auto isCompressed = [](const Image *image) {
+        return image->blockFormat.has_value();
+    };
+    Info::Log(
+        "Compressed", std::ranges::count_if(images, isCompressed), "textures in",
+        stm_sec(stm_since(timeBegin)), "seconds");
+}
+
+void Routine::reportDecoderSpeed(const std::string& path, const std::vector<uint8_t>& data) {
+    const auto decode = Image::compareDecoders({data.data(), data.size()});
+    if (!decode)
+        return;
+    const double mib = data.size() / (1024.0 * 1024.0);
+    Info::Log(
+        "[stats] Decoding", path, ": uncompressed decoder",
+        mib * 1000.0 / decode->uncompressedMs, "MiB/s, stb", mib * 1000.0 / decode->stbMs,
+        "MiB/s");
+}
+
 void Routine::updateGravity() {
     const float g = -config_.gravity * 5.0f;
     const float r = userView_.GetRotation();
     const btVector3 gravity(std::sin(r) * g, std::cos(r) * g, 0);
     mmd_.GetModel()->GetMMDPhysics()->GetDynamicsWorld()->setGravity(gravity);
 }
+
+void Routine::reduceMotion(size_t motionID) {
+    auto& motion = *mmd_.GetAnimations()[motionID].first;
+    const auto stats = motion.Reduce({
+        .rotation = glm::radians(config_.keyframeRotationTolerance),
+        .translation = config_.keyframeTranslationTolerance,
+    });
+    Info::Log(
+        "Reduced bone keys of motion", motionID, "from", stats.keysBefore, "to",
+        stats.keysAfter, "keys,", stats.bytesBefore, "to", stats.bytesAfter,
+        "bytes, max error", glm::degrees(stats.maxRotationError), "degrees and",
+        stats.maxTranslationError);
+}
+
+void Routine::reportStats() {
+    const auto stats = Allocator::GetStats();
+    const double allocsPerFrame =
+        stats.frames == 0 ? 0.0 : static_cast<double>(stats.frameAllocs) / stats.frames;
+    Info::Log(
+        "[stats] Physics memory: live", stats.liveBytes, "bytes in", stats.liveCount,
+        "blocks, reserved", stats.reservedBytes, "bytes,", stats.largeCount, "large blocks");
+    Info::Log(
+        "[stats] Physics allocations per frame: average", allocsPerFrame, "max",
+        stats.maxFrameAllocs);
+#ifdef YOMMD_TRACK_ALLOCATIONS
+    const auto tracked = AllocationTracker::GetStats();
+    Info::Log(
+        "[stats] Heap allocations in Update and Draw:", tracked.allocs, "allocations of",
+        tracked.bytes, "bytes");
+    AllocationTracker::ResetStats();
+#endif
+
+    constexpr std::array<const char *, Enum::underlyCast(UpdatePhase::Count)> phaseNames = {
+        "evaluate",
+        "morph",
+        "node-before-physics",
+        "physics",
+        "node-after-physics",
+        "skinning",
+        "upload",
+    };
+    for (size_t i = 0; i < phaseTimes_.size(); ++i) {
+        const double ms = stm_ms(phaseTimes_[i]) / std::max<size_t>(statsFrames_, 1);
+        Info::Log("[stats] Update phase", phaseNames[i], ms, "ms/frame");
+    }
+    phaseTimes_.fill(0);
+    statsFrames_ = 0;
+
+    auto& skeleton = mmd_.GetSkeleton();
+    for (const auto& ik : skeleton.GetIKStats()) {
+        const double iterations =
+            ik.solves == 0 ? 0.0 : static_cast<double>(ik.iterations) / ik.solves;
+        Info::Log(
+            "[stats] IK", ik.name, "solved", ik.solves, "times with", iterations,
+            "iterations on average, skipped", ik.skips, "times");
+    }
+    skeleton.ResetIKStats();
+
+    auto& mesh = mmd_.GetMesh();
+    if (mesh.IsCacheEnabled()) {
+        const auto cache = mesh.GetCacheStats();
+        Info::Log(
+            "[stats] Vertex cache:", cache.frames, "frames in", cache.bytes, "bytes,",
+            cache.hits, "hits,", cache.misses, "misses");
+        mesh.ResetCacheStats();
+    }
+
+    Allocator::ResetFrameStats();
+    timeLastStats_ = stm_now();
+}
+
+// Compared once in the first pose of the first motion, since skinning the
+// model 8 times in a frame would make a hitch every stats interval.
+void Routine::reportSkinning() {
+    const auto skinning = mmd_.GetMesh().CompareSkinning(mmd_.GetMorphs());
+    if (skinning) {
+        Info::Log(
+            "[stats] Skinning: linear", skinning->linearMs, "ms, dual quaternion",
+            skinning->dualQuaternionMs, "ms, position difference max", skinning->maxError,
+            "mean", skinning->meanError);
+    }
+}
@@ -1,16 +1,23 @@
 #ifndef VIEWER_HPP_
 #define VIEWER_HPP_
 
+#include <array>
+#include <deque>
 #include <filesystem>
 #include <functional>
 #include <map>
 #include <random>
 #include "Saba/Model/MMD/MMDMaterial.h"
 #include "Saba/Model/MMD/MMDModel.h"
-#include "Saba/Model/MMD/VMDAnimation.h"
 #include "Saba/Model/MMD/VMDCameraAnimation.h"
+#include "allocator.hpp"
 #include "config.hpp"
 #include "image.hpp"
+#include "mesh.hpp"
+#include "morph.hpp"
+#include "motion.hpp"
+#include "physics.hpp"
+#include "skeleton.hpp"
 #include "sokol_gfx.h"
 #include "util.hpp"
 
@@ -44,22 +51,37 @@ public:
     std::optional<SgImageView> texture;
     std::optional<SgImageView> spTexture;
     std::optional<SgImageView> toonTexture;
-    bool textureHasAlpha;
+    AlphaUsage textureAlpha;
+
+    // Scale in xy and offset in zw of UVs into the atlas of the texture.
+    glm::vec4 textureTransform;
+    glm::vec4 spTextureTransform;
+
+    // Alpha usage of the material combined with its texture.  Material morphs
+    // may change the material alpha at any frame.
+    AlphaUsage GetAlphaUsage() const;
 };
 
 class MMD : private NonCopyable {
 public:
     using Path = std::filesystem::path;
-    using Animation = std::
-        pair<std::unique_ptr<saba::VMDAnimation>, std::unique_ptr<saba::VMDCameraAnimation>>;
+    using Animation =
+        std::pair<std::unique_ptr<Motion>, std::unique_ptr<saba::VMDCameraAnimation>>;
     void LoadModel(const Path& modelPath, const Path& resourcePath);
     void LoadMotion(const std::vector<Path>& paths);
     bool IsModelLoaded() const;
     const std::shared_ptr<saba::MMDModel> GetModel() const;
     const std::vector<Animation>& GetAnimations() const;
+    Skeleton& GetSkeleton();
+    MorphSet& GetMorphs();
+    Mesh& GetMesh();
 
 private:
     std::shared_ptr<saba::MMDModel> model_;
+    Skeleton skeleton_;
+    MorphSet morphs_;
+    Mesh mesh_;
+    MotionTargets motionTargets_;
     std::vector<Animation> animations_;
 };
 
@@ -153,6 +175,18 @@ private:
     Callback callback_;
 };
 
+// Steps of Routine::Update() measured for statistics.
+enum class UpdatePhase {
+    Evaluate,
+    Morph,
+    NodeBeforePhysics,
+    Physics,
+    NodeAfterPhysics,
+    Skinning,
+    Upload,
+    Count,
+};
+
 class Routine : private NonCopyable {
 public:
     Routine();
@@ -176,10 +210,27 @@ private:
     void initBuffers();
     void initTextures();
     void initPipeline();
+    void initPhysicsSnapshots();
+    const PhysicsSnapshot& getPhysicsSnapshot(size_t motionID);
     void selectNextMotion();
+    void warmStartMotion();
+    void loadImages(const std::vector<std::string>& paths);
     std::optional<ImageMap::const_iterator> loadImage(const std::string& path);
     std::optional<SgImageView> getTexture(const std::string& path);
+    bool queueImage(const std::string& path, std::vector<ImageStreamer::Job>& jobs);
+    void streamTextures();
+    void setStreamedTexture(
+        const std::string& path, const SgImageView& texture, AlphaUsage alphaUsage);
+    void reportDeduplication();
+    const std::string& resolveImagePath(const std::string& path) const;
+    void capTextureSize();
+    void packTextureAtlases();
+    void compressTextures();
+    void reportDecoderSpeed(const std::string& path, const std::vector<uint8_t>& data);
     void updateGravity();
+    void reduceMotion(size_t motionID);
+    void reportStats();
+    void reportSkinning();
 
 private:
     struct Camera {
@@ -187,6 +238,11 @@ private:
         glm::vec3 center;
     };
 
+    struct AtlasSlot {
+        std::string atlas;    // Path of the atlas in texImages_.
+        glm::vec4 transform;  // Same as Material::textureTransform.
+    };
+
     Config config_;
 
     ModelEmphasizer modelEmphasizer_;
@@ -199,12 +255,11 @@ private:
     sg_shader shaderMMD_;
 
     std::vector<uint32_t> induces_;
-    sg_buffer posVB_;  // VB stands for "vertex buffer"
-    sg_buffer normVB_;
+    sg_buffer vertexVB_;  // VB stands for "vertex buffer"
     sg_buffer uvVB_;
     sg_buffer ibo_;
-    sg_pipeline pipeline_frontface_;
-    sg_pipeline pipeline_bothface_;
+    // Indexed by AlphaUsage and then by whether to draw both faces.
+    std::array<std::array<sg_pipeline, 2>, Enum::underlyCast(AlphaUsage::Count)> pipelines_;
     sg_bindings binds_;
 
     glm::mat4 viewMatrix_;        // For model-view transformation
@@ -213,7 +268,18 @@ private:
 
     SgImageView dummyTex_;
     ImageMap texImages_;
+    std::map<std::string, std::string> imageAliases_;  // Path to the path in texImages_.
+    std::multimap<uint64_t, std::string> imagePathByHash_;  // Content hash to the paths.
+    size_t dedupedBytes_;  // Image bytes not loaded again thanks to imageAliases_.
     std::map<std::string, SgImageView> textures_;
+    std::map<std::string, AtlasSlot> atlasSlots_;  // Keyed by the path in texImages_.
+    BlockFormats blockFormats_;  // Formats to compress textures into.
+    ImageStreamer imageStreamer_;
+    bool streamingTextures_;
+    uint64_t timeBeginStreaming_;
+    std::vector<DecodedImage> decodedImages_;
+    std::deque<std::string> pendingUploads_;  // Decoded images to make textures of.
+    std::map<std::string, SgImageView> placeholders_;  // Shown until uploaded.
     std::vector<Material> materials_;
     sg_sampler sampler_texture_;
     sg_sampler sampler_sphere_texture_;
@@ -225,9 +291,17 @@ private:
     uint64_t timeBeginAnimation_;
     uint64_t timeLastFrame_;
 
+    uint64_t timeLastStats_;
+    size_t statsFrames_;
+    std::array<uint64_t, Enum::underlyCast(UpdatePhase::Count)> phaseTimes_;
+
     size_t motionID_;
     bool needBridgeMotions_;
     std::vector<unsigned int> motionWeights_;
+    // Indexed by motionID_.  Settled when the motion is first warm-started.
+    std::vector<std::optional<PhysicsSnapshot>> physicsSnapshots_;
+    std::vector<std::filesystem::path> physicsSnapshotPaths_;  // Empty without the cache.
+    PhysicsLOD physicsLOD_;
 
     std::mt19937 rand_;
     std::uniform_int_distribution<size_t> randDist_;
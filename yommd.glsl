@@ -62,6 +62,14 @@ layout(binding=1) uniform u_mmd_fs {
     int u_SphereTexMode;
     vec4 u_SphereTexMulFactor;
     vec4 u_SphereTexAddFactor;
+
+    // Alpha below which pixels are discarded, or 0 to blend them.
+    float u_AlphaCutoff;
+
+    // Scale in xy and offset in zw of UVs to the place of the texture in its
+    // atlas.
+    vec4 u_TexTransform;
+    vec4 u_SphereTexTransform;
 };
 
 layout(binding=0) uniform texture2D u_Tex;
@@ -100,7 +108,8 @@ void main()
 
     if (u_TexMode != 0)
     {
-        vec4 texColor = texture(sampler2D(u_Tex, u_Tex_smp), vs_UV);
+        vec2 uv = vs_UV * u_TexTransform.xy + u_TexTransform.zw;
+        vec4 texColor = texture(sampler2D(u_Tex, u_Tex_smp), uv);
         texColor.rgb = ComputeTexMulFactor(texColor.rgb, u_TexMulFactor);
         texColor.rgb = ComputeTexAddFactor(texColor.rgb, u_TexAddFactor);
         color *= texColor.rgb;
@@ -110,16 +119,21 @@ void main()
         }
     }
 
-    if (alpha == 0.0)
+    if (alpha == 0.0 || alpha < u_AlphaCutoff)
     {
         discard;
     }
+    if (u_AlphaCutoff > 0.0)
+    {
+        alpha = 1.0;
+    }
 
     if (u_SphereTexMode != 0)
     {
         vec2 spUV = vec2(0.0);
         spUV.x = nor.x * 0.5 + 0.5;
         spUV.y = 1.0 - (nor.y * 0.5 + 0.5);
+        spUV = spUV * u_SphereTexTransform.xy + u_SphereTexTransform.zw;
         vec3 spColor = texture(sampler2D(u_SphereTex, u_SphereTex_smp), spUV).rgb;
         spColor = ComputeTexMulFactor(spColor, u_SphereTexMulFactor);
         spColor = ComputeTexAddFactor(spColor, u_SphereTexAddFactor);